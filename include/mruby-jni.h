@@ -1,6 +1,26 @@
-#include <jni.h>
-
-mrb_value mrb_mruby_jni_wrap_jobject(mrb_state *mrb, struct RClass *klass, jobject jobj);
-mrb_value mrb_mruby_jni_jclass2mclass(mrb_state *mrb, jobject jobj, mrb_value mobj);
-int mrb_mruby_jni_check_exc(mrb_state *mrb);
-struct RClass *mrb_mruby_jni_init(mrb_state *mrb);
+#include <jni.h>
+
+mrb_value mrb_mruby_jni_wrap_jobject(mrb_state *mrb, struct RClass *klass, jobject jobj);
+mrb_value mrb_mruby_jni_jclass2mclass(mrb_state *mrb, jobject jobj, mrb_value mobj);
+int mrb_mruby_jni_check_exc(mrb_state *mrb);
+
+/*
+ * mrb_mruby_jni_init expects mrb->ud to hold the caller's JNIEnv; both init
+ * functions replace mrb->ud with the gem's per-state context.  Each
+ * mrb_state may be initialized and used on its own thread; use
+ * mrb_mruby_jni_env to get the JNIEnv of the calling thread.  Both return
+ * NULL if the context can't be allocated, leaving mrb->ud untouched;
+ * the gem only frees a context it installed itself.
+ */
+struct RClass *mrb_mruby_jni_init(mrb_state *mrb);
+struct RClass *mrb_mruby_jni_init_vm(mrb_state *mrb, JavaVM *vm);
+JNIEnv *mrb_mruby_jni_env(mrb_state *mrb);
+
+/* conversions used by bindings generated with tools/jni_bindgen.rb */
+mrb_value mrb_mruby_jni_jstr2mstr(mrb_state *mrb, jstring jstr);
+jstring mrb_mruby_jni_mstr2jstr(mrb_state *mrb, mrb_value mstr);
+mrb_value mrb_mruby_jni_jlong2mlong(mrb_state *mrb, jlong jl);
+jlong mrb_mruby_jni_mlong2jlong(mrb_state *mrb, mrb_value mobj);
+jobject mrb_mruby_jni_jobject(mrb_state *mrb, mrb_value mobj);
+mrb_value mrb_mruby_jni_jobj2mobj(mrb_state *mrb, mrb_value mrecv, jobject jobj);
+void mrb_mruby_jni_raise_jexc(mrb_state *mrb, const char *mname);
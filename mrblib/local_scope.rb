@@ -0,0 +1,19 @@
+module Jni
+  # Runs the block inside a JNI local frame. Java objects returned while the
+  # block runs are wrapped with local references. The block's result (or
+  # the elements of a returned Array) escapes as global references; other
+  # wrappers from the scope lose their Java object when it ends, and using
+  # them raises. Escapes are only detected in the result: wrappers kept in
+  # instance variables, Hashes, nested Arrays, closures or outer locals are
+  # not. Use Jni.promote to keep one alive explicitly.
+  def self.local_scope(capacity = 16)
+    push_local_frame(capacity)
+    ret = nil
+    begin
+      ret = yield
+    ensure
+      ret = pop_local_frame(ret)
+    end
+    ret
+  end
+end
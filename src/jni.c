@@ -1,811 +1,4724 @@
 #include <jni.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "mruby.h"
 #include "mruby/array.h"
 #include "mruby/class.h"
 #include "mruby/data.h"
+#include "mruby/hash.h"
 #include "mruby/string.h"
+#include "mruby/throw.h"
 #include "mruby/variable.h"
 
 int debug = 0;
 
-static void jobj_free(mrb_state *mrb, void *p) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  if (p) {
-    (*env)->DeleteGlobalRef(env, (jobject)p);
-  }
-}
+/* per-method counters (Jni.stats); MRUBY_JNI_STATS=0 compiles them out */
+#ifndef MRUBY_JNI_STATS
+#define MRUBY_JNI_STATS 1
+#endif
 
-static const struct mrb_data_type jobj_data_type = {
-  "jobject", jobj_free,
+#if MRUBY_JNI_STATS
+struct jmeth_stats {
+  struct jmeth_stats *prev, *next; /* ring headed by ctx->stats_list */
+  char *label; /* "path#name(sig)", "." for static methods */
+  unsigned long calls;
+  unsigned long check_misses; /* argument tuples rejected by the plan */
+  unsigned long transitions; /* JNI calls made for the method, its own included */
+  unsigned long strings; /* strings converted in either direction */
+  unsigned long global_refs;
+  double marshal_ns; /* argument conversion and cleanup */
+  double java_ns; /* the Java call, return conversion included */
 };
+#endif
 
-static mrb_value jdefinition__set_class_path(mrb_state *mrb, mrb_value self) {
-  mrb_value mobj, mpath;
-  char *cpath;
-  jclass jclazz, jglobal;
-  JNIEnv* env = (JNIEnv*)mrb->ud;
+/* global refs owned by mruby objects; class cache refs are tracked but not live */
+enum jref_origin {
+  JREF_WRAP, /* wrap_jobject, promoted local wrappers, @jclassobj */
+  JREF_CONSTRUCTOR,
+  JREF_CLASS_PATH, /* class_path= */
+  JREF_CLASS_CACHE, /* jclass2mclass */
+  JREF_ARRAY, /* Jni::Array views */
+  JREF_ORIGINS
+};
 
-  mrb_get_args(mrb, "o", &mpath);
-  cpath = mrb_string_value_cstr(mrb, &mpath);
-  jclazz = (*env)->FindClass(env, cpath);
-  if ((*env)->ExceptionCheck(env)) {
-    mrb_raisef(mrb, E_NAME_ERROR, "Jni: can't get %S", mpath);
-  }
+static const char *jref_origin_names[JREF_ORIGINS] = {
+  "wrap", "constructor", "class_path", "class_cache", "array",
+};
 
-  jglobal = (*env)->NewGlobalRef(env, jclazz);
-  mobj = mrb_obj_value(Data_Wrap_Struct(mrb, mrb->object_class, &jobj_data_type, (void*)jglobal));
-  mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, "jclass"), mobj);
+struct jref_entry {
+  jobject ref; /* NULL when the slot is empty */
+  struct RClass *klass;
+  int origin;
+};
 
-  (*env)->DeleteLocalRef(env, jclazz);
-  return mpath;
-}
+#define JREF_TABLE_MIN 256 /* power of two */
 
-int mrb_mruby_jni_check_jexc(mrb_state *mrb) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
+/* Jni.identity_map: wrappers chained by identityHashCode and by global ref */
+struct jidmap_entry {
+  struct RData *wrapper;
+  jobject ref; /* the wrapper's global ref */
+  jint hash;
+  struct jidmap_entry *next_hash;
+  struct jidmap_entry *next_ref;
+};
 
-  if ((*env)->ExceptionCheck(env)) {
-    return 1;
-    //mrb_raisef(mrb, E_RUNTIME_ERROR, "Java error TODO: show more detail");
-  }
-  return 0;
-}
+#define JIDMAP_MIN 256 /* power of two */
 
-mrb_value mrb_mruby_jni_wrap_jobject(mrb_state *mrb, struct RClass *klass, jobject jobj) {
-  mrb_value mobj;
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jobject jglobal;
+#define JNI_CONTEXT_MAGIC 0x6d6a6e69 /* "mjni" */
 
-  jglobal = (*env)->NewGlobalRef(env, jobj);
-  mobj = mrb_obj_value(Data_Wrap_Struct(mrb, klass, &jobj_data_type, (void*)jglobal));
-  (*env)->DeleteLocalRef(env, jobj);
-  return mobj;
-}
+/* per-state context in mrb->ud; JNIEnv is per thread, see jni_env */
+struct mrb_jni_context {
+  unsigned int magic; /* JNI_CONTEXT_MAGIC; mrb->ud may hold something else */
+  JavaVM *vm;
+  jobject *release_queue; /* global refs of swept wrappers */
+  int release_len;
+  int release_threshold; /* drain at the next safe point past this */
+  int release_limit; /* drain from the sweep itself past this */
+  int scope_depth; /* nesting of Jni.local_scope */
+  struct RClass *long_class; /* Jni::Long */
+  struct RClass *array_class; /* Jni::Array */
+  struct jstr_cache_entry *jstr_cache; /* Jni.string_cache, NULL when off */
+  int jstr_cache_sets;
+  unsigned long jstr_clock;
+  unsigned long jstr_hits;
+  unsigned long jstr_misses;
+  unsigned long jstr_evictions;
+  struct RClass *object_class; /* Jni::Object */
+  struct RClass *java_exception_class; /* Jni::JavaException */
+  struct jexc_map *exc_map; /* Jni.map_exception, checked in order */
+  int exc_map_len;
+  int exc_backtrace; /* append the mruby backtrace when throwing into Java */
+  jclass runtime_exception;
+  jmethodID throwable_to_string;
+  jmethodID throwable_get_stack_trace;
+  jmethodID frame_to_string;
+  struct jclass_cache_entry *class_cache; /* jclass2mclass, allocated on first use */
+  struct RArray *class_pin; /* results per entry, rooted by Jni's __class_cache__ */
+  jclass system_class;
+  jmethodID identity_hash;
+  jmethodID class_get_name;
+  struct jmanifest *manifest; /* Jni.warmup */
+  int manifest_recording; /* Jni.manifest_record */
+  unsigned long gref_live; /* global refs owned by mruby objects */
+  unsigned long gref_high;
+  unsigned long gref_soft_limit; /* Jni.ref_soft_limit, 0 when off */
+  unsigned long gref_trigger; /* collect when gref_live reaches this */
+  unsigned long gref_gc_runs;
+  int gref_gc_pending; /* collect at the next safe point */
+  struct jref_entry *jref_table; /* Jni.track_refs, NULL when off */
+  int jref_capa;
+  int jref_len;
+  unsigned long jref_by_origin[JREF_ORIGINS];
+  struct jidmap_entry **idmap; /* Jni.identity_map buckets by hash, NULL when off */
+  struct jidmap_entry **idmap_refs; /* buckets by global ref, same block */
+  int idmap_capa;
+  int idmap_len;
+  unsigned long idmap_hits;
+  unsigned long idmap_misses;
+#if MRUBY_JNI_STATS
+  int stats_on; /* Jni.stats_enabled */
+  struct jmeth_stats *stats_cur; /* method being called, NULL outside calls */
+  struct jmeth_stats stats_list;
+  unsigned long stats_calls;
+  mrb_int stats_dump_every; /* Jni.stats_dump, 0 when off */
+  int stats_dumping;
+#endif
+};
 
-struct RJMethod;
+#if MRUBY_JNI_STATS
+#define JSTATS_ADD(mrb, field, n) do { \
+  struct jmeth_stats *cur_ = ((struct mrb_jni_context *)(mrb)->ud)->stats_cur; \
+  if (cur_) { \
+    cur_->field += (n); \
+  } \
+} while (0)
+#else
+#define JSTATS_ADD(mrb, field, n) ((void)0)
+#endif
 
-typedef mrb_value (*caller_t)(mrb_state*, mrb_value, struct RJMethod*);
+#define RELEASE_THRESHOLD 256
+#define RELEASE_LIMIT 4096
 
-struct RJMethod {
-  jmethodID id;
-  caller_t caller;
-  union opt1 {
-    struct RClass *klass;
-    struct RObject *obj;
-  } opt1;
-  union opt2 {
-    int depth;
-  } opt2;
-  int argc;
-  jvalue *argv;
-  char *types;
+#define JCLASS_CACHE_SIZE 256 /* power of two */
+
+struct jclass_cache_entry {
+  jclass jclazz; /* global ref, NULL when the slot is empty */
+  jint hash; /* System.identityHashCode */
+  struct RClass *recv; /* class of the receiver name2class was sent to */
 };
 
-static void jmeth_free(mrb_state *mrb, void *p) {
-  struct RJMethod *smeth = (struct RJMethod *)p;
-  if (smeth->argv) {
-    free(smeth->argv);
-  }
-  if (smeth->types) {
-    free(smeth->types);
-  }
-  free(p);
-}
+#define JSTR_CACHE_WAYS 4
+#define JSTR_CACHE_MAX_LEN 64
 
-static const struct mrb_data_type jmeth_data_type = {
-  "jmethod", jmeth_free,
+struct jstr_cache_entry {
+  jstring jstr; /* global ref, NULL when the slot is empty */
+  unsigned long stamp;
+  unsigned int hash;
+  int len;
+  char bytes[JSTR_CACHE_MAX_LEN];
 };
 
-static jarray jmeth_i__start_enum_ary(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth, mrb_value *pmary, int *psize) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jarray jary;
+static JavaVM *jni_vm = NULL; /* JNI allows a single VM per process */
+static pthread_key_t jni_env_key;
+static pthread_key_t jni_attached_key;
+static pthread_key_t jni_state_key; /* mrb_state owned by this thread */
+static pthread_once_t jni_key_once = PTHREAD_ONCE_INIT;
 
-  jary = (jarray)(*env)->CallObjectMethodA(env, (jobject)DATA_PTR(mobj), rmeth->id, rmeth->argv);
-  if (!jary) {
-    return NULL;
-  }
-  if (rmeth->opt2.depth != 1) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "TODO: return nested array");
-  }
+static double jni_now_ns(void) {
+  struct timespec ts;
 
-  *psize = (*env)->GetArrayLength(env, jary);
-  *pmary = mrb_ary_new_capa(mrb, *psize);
-  return jary;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
 }
 
-static mrb_value jmeth_i__call_void(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
+static void jni_detach(void *p) {
+  JavaVM *vm = (JavaVM *)p;
 
-  (*env)->CallVoidMethodA(env, (jobject)DATA_PTR(mobj), rmeth->id, rmeth->argv);
-  return mobj;
+  (*vm)->DetachCurrentThread(vm);
 }
 
-static mrb_value jmeth_i__call_void_static(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jclass jclazz;
+static void jni_key_init(void) {
+  pthread_key_create(&jni_env_key, NULL);
+  pthread_key_create(&jni_attached_key, jni_detach);
+  pthread_key_create(&jni_state_key, NULL);
+}
 
-  jclazz = (jclass)DATA_PTR(mrb_iv_get(mrb, mobj, mrb_intern_cstr(mrb, "jclass")));
-  (*env)->CallStaticVoidMethodA(env, jclazz, rmeth->id, rmeth->argv);
-  return mobj;
+static JNIEnv *jni_attach(mrb_state *mrb) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  JavaVM *vm = ctx ? ctx->vm : jni_vm;
+  JNIEnv *env = NULL;
+
+  if (!vm) {
+    return NULL;
+  }
+  if ((*vm)->GetEnv(vm, (void**)&env, JNI_VERSION_1_6) == JNI_EDETACHED) {
+    if ((*vm)->AttachCurrentThread(vm, (void**)&env, NULL) != JNI_OK) {
+      return NULL;
+    }
+    pthread_setspecific(jni_attached_key, vm);
+  }
+  pthread_setspecific(jni_env_key, env);
+  return env;
 }
 
-static mrb_value jmeth_i__call_bool(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jboolean jb;
+static inline JNIEnv *jni_env(mrb_state *mrb) {
+  JNIEnv *env = (JNIEnv*)pthread_getspecific(jni_env_key);
 
-  jb = (*env)->CallBooleanMethodA(env, (jobject)DATA_PTR(mobj), rmeth->id, rmeth->argv);
-  return mrb_bool_value(jb);
+  if (!env) {
+    env = jni_attach(mrb);
+  }
+  return env;
 }
 
-static mrb_value jmeth_i__call_int(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jint ji;
+JNIEnv *mrb_mruby_jni_env(mrb_state *mrb) {
+  return jni_env(mrb);
+}
 
-  ji = (*env)->CallIntMethodA(env, (jobject)DATA_PTR(mobj), rmeth->id, rmeth->argv);
-  return mrb_fixnum_value(ji);
+static inline unsigned int jref_hash(jobject ref) {
+  return (unsigned int)(((uintptr_t)ref >> 3) * 2654435761u);
 }
 
-static mrb_value jmeth_i__call_int_ary(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jarray jary;
-  mrb_value mitem, mary;
-  int i, ai, size;
-  jint *jints;
+static struct jref_entry *jref_lookup(struct mrb_jni_context *ctx, jobject ref) {
+  unsigned int mask = ctx->jref_capa - 1;
+  unsigned int i = jref_hash(ref) & mask;
 
-  jary = jmeth_i__start_enum_ary(mrb, mobj, rmeth, &mary, &size);
-  if (!jary) {
-    return mrb_nil_value();
+  while (ctx->jref_table[i].ref) {
+    if (ctx->jref_table[i].ref == ref) {
+      return ctx->jref_table + i;
+    }
+    i = (i + 1) & mask;
   }
-  jints = (*env)->GetIntArrayElements(env, jary, NULL);
+  return NULL;
+}
 
-  for (i = 0; i < size; i++) {
-    ai = mrb_gc_arena_save(mrb);
-    mitem = mrb_fixnum_value(jints[i]);
-    mrb_ary_push(mrb, mary, mitem);
-    mrb_gc_arena_restore(mrb, ai);
+static void jref_insert(struct mrb_jni_context *ctx, jobject ref, struct RClass *klass, int origin) {
+  unsigned int mask = ctx->jref_capa - 1;
+  unsigned int i = jref_hash(ref) & mask;
+
+  while (ctx->jref_table[i].ref) {
+    i = (i + 1) & mask;
   }
-  (*env)->ReleaseIntArrayElements(env, jary, jints, 0);
-  (*env)->DeleteLocalRef(env, jary);
-  return mary;
+  ctx->jref_table[i].ref = ref;
+  ctx->jref_table[i].klass = klass;
+  ctx->jref_table[i].origin = origin;
+  ctx->jref_len++;
+  ctx->jref_by_origin[origin]++;
 }
 
-static mrb_value jmeth_i__call_int_static(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jint ji;
-  jclass jclazz;
+static int jref_grow(struct mrb_jni_context *ctx) {
+  struct jref_entry *old = ctx->jref_table;
+  int i, capa = ctx->jref_capa;
+  struct jref_entry *table = (struct jref_entry *)calloc(capa * 2, sizeof(struct jref_entry));
 
-  jclazz = (jclass)DATA_PTR(mrb_iv_get(mrb, mobj, mrb_intern_cstr(mrb, "jclass")));
-  ji = (*env)->CallStaticIntMethodA(env, jclazz, rmeth->id, rmeth->argv);
-  return mrb_fixnum_value(ji);
+  if (!table) {
+    return 0;
+  }
+  ctx->jref_table = table;
+  ctx->jref_capa = capa * 2;
+  ctx->jref_len = 0;
+  memset(ctx->jref_by_origin, 0, sizeof(ctx->jref_by_origin));
+  for (i = 0; i < capa; i++) {
+    if (old[i].ref) {
+      jref_insert(ctx, old[i].ref, old[i].klass, old[i].origin);
+    }
+  }
+  free(old);
+  return 1;
 }
 
-static mrb_value jlong2mlong(mrb_state *mrb, jlong jl) {
-  mrb_value mmod;
-  mrb_value mlong[2];
-  unsigned long long bits = (unsigned long long) jl;
+/* remove with backward shifting, keeping probe chains intact */
+static void jref_remove(struct mrb_jni_context *ctx, struct jref_entry *entry) {
+  unsigned int mask = ctx->jref_capa - 1;
+  unsigned int i = entry - ctx->jref_table, j = i, k;
 
-  mmod = mrb_const_get(mrb, mrb_obj_value(mrb->object_class), mrb_intern_cstr(mrb, "Jni"));
-  mmod = mrb_const_get(mrb, mmod, mrb_intern_cstr(mrb, "J"));
-  mmod = mrb_const_get(mrb, mmod, mrb_intern_cstr(mrb, "Long"));
-  mlong[0] = mrb_fixnum_value((int)((bits<<32)>>32));
-  mlong[1] = mrb_fixnum_value((int)(bits>>32));
-  return mrb_obj_new(mrb, mrb_class_ptr(mmod), 2, mlong);
+  ctx->jref_len--;
+  ctx->jref_by_origin[entry->origin]--;
+  entry->ref = NULL;
+  for (;;) {
+    j = (j + 1) & mask;
+    if (!ctx->jref_table[j].ref) {
+      break;
+    }
+    k = jref_hash(ctx->jref_table[j].ref) & mask;
+    if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+      ctx->jref_table[i] = ctx->jref_table[j];
+      ctx->jref_table[j].ref = NULL;
+      i = j;
+    }
+  }
 }
 
-static mrb_value jmeth_i__call_long(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jlong jl;
+static void jref_untrack(struct mrb_jni_context *ctx, jobject ref) {
+  struct jref_entry *entry;
 
-  jl = (*env)->CallLongMethodA(env, (jobject)DATA_PTR(mobj), rmeth->id, rmeth->argv);
-  return jlong2mlong(mrb, jl);
+  if (ctx->jref_table && (entry = jref_lookup(ctx, ref))) {
+    jref_remove(ctx, entry);
+  }
 }
 
-static mrb_value jmeth_i__call_long_ary(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jarray jary;
-  mrb_value mitem, mary;
-  int i, ai, size;
-  jlong *jlongs;
+/* call right before DeleteGlobalRef of a counted ref */
+static void jref_deleted(mrb_state *mrb, jobject ref) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
 
-  jary = jmeth_i__start_enum_ary(mrb, mobj, rmeth, &mary, &size);
-  if (!jary) {
-    return mrb_nil_value();
+  if (!ctx || !ref) {
+    return;
   }
-  jlongs = (*env)->GetLongArrayElements(env, jary, NULL);
-
-  for (i = 0; i < size; i++) {
-    ai = mrb_gc_arena_save(mrb);
-    mitem = jlong2mlong(mrb, jlongs[i]);
-    mrb_ary_push(mrb, mary, mitem);
-    mrb_gc_arena_restore(mrb, ai);
+  if (ctx->gref_live) {
+    ctx->gref_live--;
   }
-  (*env)->ReleaseLongArrayElements(env, jary, jlongs, 0);
-  (*env)->DeleteLocalRef(env, jary);
-  return mary;
+  jref_untrack(ctx, ref);
 }
 
-static mrb_value jmeth_i__call_float(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jfloat jf;
+static int jni_flush_refs(mrb_state *mrb) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  int i, len = ctx->release_len;
 
-  jf = (*env)->CallFloatMethodA(env, (jobject)DATA_PTR(mobj), rmeth->id, rmeth->argv);
-  return mrb_float_value(mrb, jf);
+  for (i = 0; i < len; i++) {
+    jref_deleted(mrb, ctx->release_queue[i]);
+    (*env)->DeleteGlobalRef(env, ctx->release_queue[i]);
+  }
+  ctx->release_len = 0;
+  return len;
 }
 
-static mrb_value jstr2mstr(mrb_state *mrb, jstring jstr) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  mrb_value mstr;
-  jsize size;
-  const char *cstr;
-
-  size = (*env)->GetStringUTFLength(env, jstr);
-  cstr = (*env)->GetStringUTFChars(env, jstr, NULL);
-  mstr = mrb_str_new(mrb, cstr, size);
+/* count a new global ref; past the soft limit a collection is requested.
+   Class cache refs are only tracked: a collection can't release them */
+static void jref_created(mrb_state *mrb, jobject ref, struct RClass *klass, int origin) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
 
-  (*env)->ReleaseStringUTFChars(env, jstr, cstr);
-  (*env)->DeleteLocalRef(env, jstr);
-  return mstr;
+  if (!ref) {
+    return;
+  }
+  if (ctx->jref_table && ((ctx->jref_len + 1) * 2 <= ctx->jref_capa || jref_grow(ctx))) {
+    jref_insert(ctx, ref, klass, origin);
+  }
+  if (origin == JREF_CLASS_CACHE) {
+    return;
+  }
+  ctx->gref_live++;
+  if (ctx->gref_live > ctx->gref_high) {
+    ctx->gref_high = ctx->gref_live;
+  }
+  if (ctx->gref_soft_limit && ctx->gref_live >= ctx->gref_trigger) {
+    ctx->gref_gc_pending = 1;
+  }
 }
 
-static mrb_value jmeth_i__call_str(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jstring jstr;
+/* if that doesn't get below the limit, wait for another quarter of it */
+static void jref_collect(mrb_state *mrb) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
 
-  jstr = (*env)->CallObjectMethodA(env, (jobject)DATA_PTR(mobj), rmeth->id, rmeth->argv);
-  if (!jstr) {
-    return mrb_nil_value();
+  ctx->gref_gc_pending = 0;
+  mrb_full_gc(mrb);
+  jni_flush_refs(mrb);
+  ctx->gref_gc_runs++;
+  ctx->gref_trigger = ctx->gref_soft_limit;
+  if (ctx->gref_live >= ctx->gref_soft_limit) {
+    ctx->gref_trigger = ctx->gref_live + (ctx->gref_soft_limit + 3) / 4;
   }
-  return jstr2mstr(mrb, jstr);
 }
 
-static mrb_value jmeth_i__wrap_jclassobj(mrb_state *mrb, mrb_value mobj, jobject jobj) {
-  mrb_value mclassclass;
-  mclassclass = mrb_str_new(mrb, "java.lang.Class", 15);
-  mclassclass = mrb_funcall(mrb, mobj, "name2class", 1, mclassclass);
-  return mrb_mruby_jni_wrap_jobject(mrb, mrb_class_ptr(mclassclass), jobj);
+/* called before Java calls; drains refs queued by the garbage collector */
+static inline void jni_safe_point(mrb_state *mrb) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+
+  if (ctx->gref_gc_pending) {
+    jref_collect(mrb);
+  } else if (ctx->release_len >= ctx->release_threshold && ctx->release_len) {
+    jni_flush_refs(mrb);
+  }
 }
 
-mrb_value mrb_mruby_jni_jclass2mclass(mrb_state *mrb, jobject jobj, mrb_value mobj) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jstring jname;
-  mrb_value mret, mclass, mname, mclassobj;
-  const char *cname;
-  jsize size;
+/* java.lang.System and identityHashCode, shared by the class cache and identity map */
+static void jni_identity_init(mrb_state *mrb) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
   jclass jclazz;
-  jmethodID jmeth;
 
-  if (!jobj) {
-    return mrb_nil_value();
+  if (ctx->identity_hash) {
+    return;
   }
-  jclazz = (*env)->GetObjectClass(env, jobj);
-  jmeth = (*env)->GetMethodID(env, jclazz, "getName", "()Ljava/lang/String;");
+  jclazz = (*env)->FindClass(env, "java/lang/System");
+  ctx->system_class = (jclass)(*env)->NewGlobalRef(env, jclazz);
+  ctx->identity_hash = (*env)->GetStaticMethodID(env, jclazz, "identityHashCode", "(Ljava/lang/Object;)I");
   (*env)->DeleteLocalRef(env, jclazz);
+}
 
-  jname = (*env)->CallObjectMethod(env, jobj, jmeth);
-  size = (*env)->GetStringUTFLength(env, jname);
-  cname = (*env)->GetStringUTFChars(env, jname, NULL);
-  mname = mrb_str_new(mrb, cname, size);
-  (*env)->ReleaseStringUTFChars(env, jname, cname);
-  (*env)->DeleteLocalRef(env, jname);
+static inline jint jni_identity_hash(mrb_state *mrb, jobject jobj) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
 
-  mret = mclass = mrb_funcall(mrb, mobj, "name2class", 1, mname);
-  while (mrb_type(mclass) == MRB_TT_ARRAY) {
-    mclass = mrb_ary_ref(mrb, mclass, 0);
-  }
-  if (mrb_nil_p(mclass)) {
-    return jmeth_i__wrap_jclassobj(mrb, mobj, jobj);
-  }
-  mclassobj = mrb_iv_get(mrb, mclass, mrb_intern_cstr(mrb, "@jclassobj"));
-  if (mrb_nil_p(mclassobj)) {
-    mclassobj = jmeth_i__wrap_jclassobj(mrb, mobj, jobj);
-    mrb_iv_set(mrb, mclass, mrb_intern_cstr(mrb, "@jclassobj"), mclassobj);
-  } else {
-    (*env)->DeleteLocalRef(env, jobj);
-  }
-  return mret;
+  return (*env)->CallStaticIntMethod(env, ctx->system_class, ctx->identity_hash, jobj);
 }
 
-static mrb_value jmeth_i__call_class(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jobject jobj;
+static inline unsigned int jidmap_slot(struct mrb_jni_context *ctx, jint hash) {
+  return ((unsigned int)hash * 2654435761u) & (ctx->idmap_capa - 1);
+}
 
-  jobj = (*env)->CallObjectMethodA(env, (jobject)DATA_PTR(mobj), rmeth->id, rmeth->argv);
-  return mrb_mruby_jni_jclass2mclass(mrb, jobj, mobj);
+static inline unsigned int jidmap_ref_slot(struct mrb_jni_context *ctx, jobject ref) {
+  return (unsigned int)(((uintptr_t)ref >> 3) * 2654435761u) & (ctx->idmap_capa - 1);
 }
 
-static mrb_value jmeth_i__call_class_ary(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jobject jobj;
-  jarray jary;
-  mrb_value mitem, mary;
-  int i, ai, size;
+static int jidmap_alloc(struct mrb_jni_context *ctx, int capa) {
+  struct jidmap_entry **buckets = (struct jidmap_entry **)calloc(capa * 2, sizeof(struct jidmap_entry *));
 
-  jary = jmeth_i__start_enum_ary(mrb, mobj, rmeth, &mary, &size);
-  if (!jary) {
-    return mrb_nil_value();
+  if (!buckets) {
+    return 0;
   }
+  ctx->idmap = buckets;
+  ctx->idmap_refs = buckets + capa;
+  ctx->idmap_capa = capa;
+  return 1;
+}
 
-  for (i = 0; i < size; i++) {
-    ai = mrb_gc_arena_save(mrb);
-    jobj = (*env)->GetObjectArrayElement(env, jary, i);
-    mitem = mrb_mruby_jni_jclass2mclass(mrb, jobj, mobj);
-    mrb_ary_push(mrb, mary, mitem);
-    mrb_gc_arena_restore(mrb, ai);
-  }
-  (*env)->DeleteLocalRef(env, jary);
-  return mary;
+static void jidmap_link(struct mrb_jni_context *ctx, struct jidmap_entry *entry) {
+  unsigned int i = jidmap_slot(ctx, entry->hash), j = jidmap_ref_slot(ctx, entry->ref);
+
+  entry->next_hash = ctx->idmap[i];
+  ctx->idmap[i] = entry;
+  entry->next_ref = ctx->idmap_refs[j];
+  ctx->idmap_refs[j] = entry;
 }
 
-static mrb_value jmeth_i__call_class_static(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jobject jobj;
-  jclass jclazz;
+static void jidmap_clear(struct mrb_jni_context *ctx) {
+  struct jidmap_entry *entry, *next;
+  int i;
 
-  jclazz = (jclass)DATA_PTR(mrb_iv_get(mrb, mobj, mrb_intern_cstr(mrb, "jclass")));
-  jobj = (*env)->CallStaticObjectMethodA(env, jclazz, rmeth->id, rmeth->argv);
-  if (!jobj) {
-    return mrb_nil_value();
+  if (!ctx->idmap) {
+    return;
+  }
+  for (i = 0; i < ctx->idmap_capa; i++) {
+    for (entry = ctx->idmap[i]; entry; entry = next) {
+      next = entry->next_hash;
+      free(entry);
+    }
   }
-  return mrb_mruby_jni_jclass2mclass(mrb, jobj, mobj);
+  free(ctx->idmap);
+  ctx->idmap = ctx->idmap_refs = NULL;
+  ctx->idmap_capa = 0;
+  ctx->idmap_len = 0;
 }
 
-static mrb_value jmeth_i__call_obj(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jobject jobj;
+/* existing wrapper of class klass for jobj, or NULL */
+static struct RData *jidmap_get(mrb_state *mrb, struct RClass *klass, jobject jobj, jint hash) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  struct jidmap_entry *entry;
 
-  jobj = (*env)->CallObjectMethodA(env, (jobject)DATA_PTR(mobj), rmeth->id, rmeth->argv);
-  if (!jobj || mrb_mruby_jni_check_jexc(mrb)) {
-    return mrb_nil_value();
+  /* the sweep may not have reached wrappers that are already dead */
+  if (mrb->gc_state != GC_STATE_SWEEP) {
+    for (entry = ctx->idmap[jidmap_slot(ctx, hash)]; entry; entry = entry->next_hash) {
+      if (entry->hash == hash && mrb_obj_class(mrb, mrb_obj_value(entry->wrapper)) == klass &&
+          (*env)->IsSameObject(env, entry->ref, jobj)) {
+        ctx->idmap_hits++;
+        return entry->wrapper;
+      }
+    }
   }
-  return mrb_mruby_jni_wrap_jobject(mrb, rmeth->opt1.klass, jobj);
+  ctx->idmap_misses++;
+  return NULL;
 }
 
-static mrb_value jmeth_i__call_obj_static(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jobject jobj;
+static void jidmap_put(mrb_state *mrb, mrb_value mobj, jint hash) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  struct jidmap_entry *entry;
 
-  mobj = mrb_iv_get(mrb, mobj, mrb_intern_cstr(mrb, "jclass"));
-  jobj = (*env)->CallStaticObjectMethodA(env, (jclass)DATA_PTR(mobj), rmeth->id, rmeth->argv);
-  if (!jobj) {
-    return mrb_nil_value();
+  if (ctx->idmap_len >= ctx->idmap_capa) {
+    struct jidmap_entry **old = ctx->idmap_refs, *next;
+    int i, capa = ctx->idmap_capa;
+
+    if (jidmap_alloc(ctx, capa * 2)) {
+      for (i = 0; i < capa; i++) {
+        for (entry = old[i]; entry; entry = next) {
+          next = entry->next_ref;
+          jidmap_link(ctx, entry);
+        }
+      }
+      free(old - capa);
+    }
   }
-  return mrb_mruby_jni_wrap_jobject(mrb, rmeth->opt1.klass, jobj);
+  entry = (struct jidmap_entry *)malloc(sizeof(struct jidmap_entry));
+  if (!entry) {
+    return;
+  }
+  entry->wrapper = RDATA(mobj);
+  entry->ref = (jobject)DATA_PTR(mobj);
+  entry->hash = hash;
+  jidmap_link(ctx, entry);
+  ctx->idmap_len++;
 }
 
-static mrb_value jmeth_i__call_obj_ary(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jobjectArray jary;
-  jobject jobj;
-  mrb_value mitem, mary;
-  int size, i;
-  int ai;
+/* called from the free hook, so no JNI: both chains are walked by stored keys */
+static void jidmap_remove(struct mrb_jni_context *ctx, jobject ref) {
+  struct jidmap_entry **link, *entry;
 
-  jary = jmeth_i__start_enum_ary(mrb, mobj, rmeth, &mary, &size);
-  if (!jary) {
-    return mrb_nil_value();
+  for (link = &ctx->idmap_refs[jidmap_ref_slot(ctx, ref)]; *link; link = &(*link)->next_ref) {
+    if ((*link)->ref == ref) {
+      break;
+    }
   }
-
-  for (i = 0; i < size; i++) {
-    ai = mrb_gc_arena_save(mrb);
-    jobj = (*env)->GetObjectArrayElement(env, jary, i);
-    mitem = mrb_mruby_jni_wrap_jobject(mrb, rmeth->opt1.klass, jobj);
-    mrb_ary_push(mrb, mary, mitem);
-    mrb_gc_arena_restore(mrb, ai);
+  if (!(entry = *link)) {
+    return;
   }
-  (*env)->DeleteLocalRef(env, jary);
-  return mary;
+  *link = entry->next_ref;
+  for (link = &ctx->idmap[jidmap_slot(ctx, entry->hash)]; *link != entry; link = &(*link)->next_hash);
+  *link = entry->next_hash;
+  ctx->idmap_len--;
+  free(entry);
 }
 
-static mrb_value jmeth_i__call_constructor(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  jclass jclazz;
-  jobject jobj;
-
-  DATA_TYPE(mobj) = &jobj_data_type;
-  DATA_PTR(mobj) = NULL;
+static void jobj_free(mrb_state *mrb, void *p) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  JNIEnv* env;
 
-  jclazz = DATA_PTR(mrb_obj_value(rmeth->opt1.obj));
-  jobj = (*env)->NewObjectA(env, jclazz, rmeth->id, rmeth->argv);
-  if (jobj) {
-    DATA_PTR(mobj) = (*env)->NewGlobalRef(env, jobj);
-    (*env)->DeleteLocalRef(env, jobj);
-  } else {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "constructor returns null");
+  if (!p) {
+    return;
   }
-  return mobj;
+  if (ctx && ctx->idmap) {
+    jidmap_remove(ctx, (jobject)p);
+  }
+  if (ctx && ctx->release_threshold > 0) {
+    if (!ctx->release_queue) {
+      ctx->release_queue = (jobject *)malloc(ctx->release_limit * sizeof(jobject));
+    }
+    if (ctx->release_queue) {
+      if (ctx->release_len >= ctx->release_limit) {
+        jni_flush_refs(mrb);
+      }
+      ctx->release_queue[ctx->release_len++] = (jobject)p;
+      return;
+    }
+  }
+  env = jni_env(mrb);
+  jref_deleted(mrb, (jobject)p);
+  (*env)->DeleteGlobalRef(env, (jobject)p);
 }
 
-#define FLAG_STATIC (1 << 8)
-#define FLAG_ARY (1 << 9)
-#define CALLER_TYPE(c, s, d) ((c) | ((s) ? FLAG_STATIC : 0) | ((d) ? FLAG_ARY : 0))
+static const struct mrb_data_type jobj_data_type = {
+  "jobject", jobj_free,
+};
 
-static inline caller_t type2caller(const char *ctype, int is_static, int depth) {
-  switch (CALLER_TYPE(ctype[0], is_static, depth)) {
-    case 'V': {
-      return jmeth_i__call_void;
-    } break;
-    case 'V' | FLAG_STATIC: {
-      return jmeth_i__call_void_static;
-    } break;
-    case 'Z': {
-      return jmeth_i__call_bool;
-    } break;
+/* wrappers created inside Jni.local_scope hold local refs owned by the frame */
+static void jobj_local_free(mrb_state *mrb, void *p) {
+}
+
+static const struct mrb_data_type jobj_local_data_type = {
+  "jobject(local)", jobj_local_free,
+};
+
+static inline int jobj_data_p(mrb_value mobj) {
+  return mrb_type(mobj) == MRB_TT_DATA &&
+    (DATA_TYPE(mobj) == &jobj_data_type || DATA_TYPE(mobj) == &jobj_local_data_type);
+}
+
+/* wrappers left behind by Jni.local_scope have no Java object */
+static void jobj_check_attached(mrb_state *mrb, mrb_value mobj) {
+  if (jobj_data_p(mobj) && !DATA_PTR(mobj)) {
+    /* not mobj itself: its to_s may well call into Java */
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: no Java object behind %S instance (released local reference?)",
+               mrb_obj_value(mrb_obj_class(mrb, mobj)));
+  }
+}
+
+/* Jni.warmup manifest: "C path" and "M key path static name sig types rtype" lines, tab-separated */
+struct jmanifest_class {
+  const char *path;
+  jclass jclazz; /* global ref once resolved */
+  int state; /* 0: pending, 1: resolved, -1: failed */
+};
+
+struct jmanifest_method {
+  const char *key;
+  const char *path;
+  const char *name;
+  const char *sig;
+  const char *types;
+  char rtype;
+  int is_static;
+  struct jmanifest_class *klass;
+  jmethodID id;
+  int state;
+};
+
+struct jmanifest {
+  char *buf; /* file contents; records point into it */
+  struct jmanifest_class *classes;
+  int nclasses;
+  struct jmanifest_method *methods;
+  int nmethods;
+  JavaVM *vm;
+  jobject loader; /* caller's context class loader, for the background thread */
+  jclass class_class;
+  jmethodID for_name;
+  pthread_mutex_t lock;
+  pthread_t thread;
+  int threaded;
+  unsigned long hits;
+  unsigned long misses;
+};
+
+static int jmanifest_class_cmp(const void *a, const void *b) {
+  return strcmp(((const struct jmanifest_class *)a)->path, ((const struct jmanifest_class *)b)->path);
+}
+
+static int jmanifest_method_cmp(const void *a, const void *b) {
+  return strcmp(((const struct jmanifest_method *)a)->key, ((const struct jmanifest_method *)b)->key);
+}
+
+static struct jmanifest_class *jmanifest_find_class(struct jmanifest *mf, const char *path) {
+  struct jmanifest_class key;
+
+  key.path = path;
+  return (struct jmanifest_class *)bsearch(&key, mf->classes, mf->nclasses, sizeof(key), jmanifest_class_cmp);
+}
+
+/* FindClass on a native thread only sees the system class loader */
+static jclass jmanifest_find(JNIEnv *env, struct jmanifest *mf, const char *path) {
+  jstring jname;
+  jclass jclazz;
+  char *name, *p;
+
+  if (!mf->loader) {
+    return (*env)->FindClass(env, path);
+  }
+  name = strdup(path);
+  if (!name) {
+    return NULL;
+  }
+  for (p = name; *p; p++) {
+    if (*p == '/') {
+      *p = '.';
+    }
+  }
+  jname = (*env)->NewStringUTF(env, name);
+  free(name);
+  if (!jname) {
+    return NULL;
+  }
+  jclazz = (jclass)(*env)->CallStaticObjectMethod(env, mf->class_class, mf->for_name, jname, JNI_TRUE, mf->loader);
+  (*env)->DeleteLocalRef(env, jname);
+  return jclazz;
+}
+
+static int jmanifest_capture_loader(JNIEnv *env, struct jmanifest *mf) {
+  jclass jthread_class = (*env)->FindClass(env, "java/lang/Thread");
+  jclass jclass_class = (*env)->FindClass(env, "java/lang/Class");
+  jmethodID current, get_loader;
+  jobject jthread, jloader = NULL;
+
+  if (jthread_class && jclass_class) {
+    current = (*env)->GetStaticMethodID(env, jthread_class, "currentThread", "()Ljava/lang/Thread;");
+    get_loader = (*env)->GetMethodID(env, jthread_class, "getContextClassLoader", "()Ljava/lang/ClassLoader;");
+    mf->for_name = (*env)->GetStaticMethodID(env, jclass_class, "forName",
+                                             "(Ljava/lang/String;ZLjava/lang/ClassLoader;)Ljava/lang/Class;");
+    if (current && get_loader && mf->for_name) {
+      jthread = (*env)->CallStaticObjectMethod(env, jthread_class, current);
+      if (jthread) {
+        jloader = (*env)->CallObjectMethod(env, jthread, get_loader);
+        (*env)->DeleteLocalRef(env, jthread);
+      }
+    }
+  }
+  if ((*env)->ExceptionCheck(env)) {
+    (*env)->ExceptionClear(env);
+    jloader = NULL;
+  }
+  if (jloader) {
+    mf->loader = (*env)->NewGlobalRef(env, jloader);
+    mf->class_class = (jclass)(*env)->NewGlobalRef(env, jclass_class);
+    (*env)->DeleteLocalRef(env, jloader);
+  }
+  if (jthread_class) {
+    (*env)->DeleteLocalRef(env, jthread_class);
+  }
+  if (jclass_class) {
+    (*env)->DeleteLocalRef(env, jclass_class);
+  }
+  return mf->loader != NULL;
+}
+
+static void jmanifest_resolve(JNIEnv *env, struct jmanifest *mf) {
+  int i;
+
+  for (i = 0; i < mf->nclasses; i++) {
+    struct jmanifest_class *klass = mf->classes + i;
+    jclass jclazz = jmanifest_find(env, mf, klass->path);
+    jclass jglobal = NULL;
+
+    if ((*env)->ExceptionCheck(env) || !jclazz) {
+      (*env)->ExceptionClear(env);
+    } else {
+      jglobal = (jclass)(*env)->NewGlobalRef(env, jclazz);
+      (*env)->DeleteLocalRef(env, jclazz);
+    }
+    pthread_mutex_lock(&mf->lock);
+    klass->jclazz = jglobal;
+    klass->state = jglobal ? 1 : -1;
+    pthread_mutex_unlock(&mf->lock);
+  }
+  for (i = 0; i < mf->nmethods; i++) {
+    struct jmanifest_method *meth = mf->methods + i;
+    jmethodID id = NULL;
+
+    if (meth->klass && meth->klass->state == 1) {
+      if (meth->is_static) {
+        id = (*env)->GetStaticMethodID(env, meth->klass->jclazz, meth->name, meth->sig);
+      } else {
+        id = (*env)->GetMethodID(env, meth->klass->jclazz, meth->name, meth->sig);
+      }
+      if ((*env)->ExceptionCheck(env)) {
+        (*env)->ExceptionClear(env);
+        id = NULL;
+      }
+    }
+    pthread_mutex_lock(&mf->lock);
+    meth->id = id;
+    meth->state = id ? 1 : -1;
+    pthread_mutex_unlock(&mf->lock);
+  }
+}
+
+static void *jmanifest_thread(void *p) {
+  struct jmanifest *mf = (struct jmanifest *)p;
+  JNIEnv *env;
+
+  if ((*mf->vm)->AttachCurrentThread(mf->vm, (void**)&env, NULL) != JNI_OK) {
+    return NULL;
+  }
+  jmanifest_resolve(env, mf);
+  (*mf->vm)->DetachCurrentThread(mf->vm);
+  return NULL;
+}
+
+static void jmanifest_free(mrb_state *mrb, struct jmanifest *mf) {
+  JNIEnv* env = jni_env(mrb);
+  int i;
+
+  if (mf->threaded) {
+    pthread_join(mf->thread, NULL);
+  }
+  for (i = 0; i < mf->nclasses; i++) {
+    if (mf->classes[i].jclazz) {
+      (*env)->DeleteGlobalRef(env, mf->classes[i].jclazz);
+    }
+  }
+  if (mf->loader) {
+    (*env)->DeleteGlobalRef(env, mf->loader);
+    (*env)->DeleteGlobalRef(env, mf->class_class);
+  }
+  pthread_mutex_destroy(&mf->lock);
+  free(mf->classes);
+  free(mf->methods);
+  free(mf->buf);
+  free(mf);
+}
+
+/* global ref to the class at path if the manifest resolved it, else NULL */
+static jclass jmanifest_class_ref(mrb_state *mrb, const char *path) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  struct jmanifest *mf = ctx->manifest;
+  struct jmanifest_class *klass;
+  jclass jclazz = NULL;
+
+  if (!mf) {
+    return NULL;
+  }
+  klass = jmanifest_find_class(mf, path);
+  if (klass) {
+    pthread_mutex_lock(&mf->lock);
+    if (klass->state == 1) {
+      jclazz = (jclass)(*env)->NewGlobalRef(env, klass->jclazz);
+    }
+    pthread_mutex_unlock(&mf->lock);
+  }
+  if (jclazz) {
+    mf->hits++;
+  } else {
+    mf->misses++;
+  }
+  return jclazz;
+}
+
+static struct jmanifest_method *jmanifest_method(mrb_state *mrb, mrb_value mkey, jclass jclazz) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  struct jmanifest *mf = ctx->manifest;
+  struct jmanifest_method key, *meth;
+  int ready = 0;
+
+  if (!mf || mrb_nil_p(mkey)) {
+    return NULL;
+  }
+  key.key = mrb_string_value_cstr(mrb, &mkey);
+  meth = (struct jmanifest_method *)bsearch(&key, mf->methods, mf->nmethods, sizeof(key), jmanifest_method_cmp);
+  if (meth) {
+    pthread_mutex_lock(&mf->lock);
+    ready = meth->state == 1 && (*env)->IsSameObject(env, meth->klass->jclazz, jclazz);
+    pthread_mutex_unlock(&mf->lock);
+  }
+  if (!ready) {
+    mf->misses++;
+    return NULL;
+  }
+  mf->hits++;
+  return meth;
+}
+
+static void jmanifest_type_name(mrb_state *mrb, mrb_value mstr, mrb_value mtype) {
+  const char *name = "?";
+
+  while (mrb_type(mtype) == MRB_TT_ARRAY && RARRAY_LEN(mtype)) {
+    mrb_str_cat(mrb, mstr, "[", 1);
+    mtype = RARRAY_PTR(mtype)[0];
+  }
+  if (mrb_type(mtype) == MRB_TT_CLASS || mrb_type(mtype) == MRB_TT_MODULE) {
+    name = mrb_class_name(mrb, mrb_class_ptr(mtype));
+  }
+  mrb_str_cat(mrb, mstr, name, strlen(name));
+}
+
+/* "path.name(Arg,Arg)Ret" for static methods, '#' for instance methods; nil without a class path */
+static mrb_value jmanifest_key(mrb_state *mrb, mrb_value miclass, int is_static, mrb_value mname, mrb_value mret, mrb_value margs) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mpath, mkey;
+  int i;
+
+  if (!ctx->manifest && !ctx->manifest_recording) {
+    return mrb_nil_value();
+  }
+  mpath = mrb_iv_get(mrb, miclass, mrb_intern_cstr(mrb, "jclass_path"));
+  if (mrb_type(mpath) != MRB_TT_STRING || mrb_type(mname) != MRB_TT_STRING || mrb_type(margs) != MRB_TT_ARRAY) {
+    return mrb_nil_value();
+  }
+  mkey = mrb_str_dup(mrb, mpath);
+  mrb_str_cat(mrb, mkey, is_static ? "." : "#", 1);
+  mrb_str_concat(mrb, mkey, mname);
+  mrb_str_cat(mrb, mkey, "(", 1);
+  for (i = 0; i < RARRAY_LEN(margs); i++) {
+    if (i) {
+      mrb_str_cat(mrb, mkey, ",", 1);
+    }
+    jmanifest_type_name(mrb, mkey, RARRAY_PTR(margs)[i]);
+  }
+  mrb_str_cat(mrb, mkey, ")", 1);
+  jmanifest_type_name(mrb, mkey, mret);
+  return mkey;
+}
+
+static void jmanifest_log(mrb_state *mrb, const char **fields, int n) {
+  mrb_value mlog = mrb_iv_get(mrb, mrb_obj_value(mrb_module_get(mrb, "Jni")), mrb_intern_cstr(mrb, "__manifest__"));
+  int i;
+
+  if (mrb_type(mlog) != MRB_TT_STRING) {
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    mrb_str_cat(mrb, mlog, fields[i], strlen(fields[i]));
+    mrb_str_cat(mrb, mlog, i == n - 1 ? "\n" : "\t", 1);
+  }
+}
+
+static void jmanifest_log_method(mrb_state *mrb, mrb_value mkey, mrb_value miclass, int is_static,
+                                 mrb_value mname, mrb_value msig, const char *types, char rtype_c) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mpath;
+  const char *fields[8];
+  char rtype[2] = { rtype_c ? rtype_c : '-', '\0' };
+
+  if (!ctx->manifest_recording || mrb_nil_p(mkey)) {
+    return;
+  }
+  mpath = mrb_iv_get(mrb, miclass, mrb_intern_cstr(mrb, "jclass_path"));
+  fields[0] = "M";
+  fields[1] = mrb_string_value_cstr(mrb, &mkey);
+  fields[2] = mrb_string_value_cstr(mrb, &mpath);
+  fields[3] = is_static ? "1" : "0";
+  fields[4] = mrb_string_value_cstr(mrb, &mname);
+  fields[5] = mrb_string_value_cstr(mrb, &msig);
+  fields[6] = types;
+  fields[7] = rtype;
+  jmanifest_log(mrb, fields, 8);
+}
+
+static int jmanifest_split(char *line, char **fields, int max) {
+  int n = 0;
+
+  fields[n++] = line;
+  while (*line && n < max) {
+    if (*line == '\t') {
+      *line = '\0';
+      fields[n++] = line + 1;
+    }
+    line++;
+  }
+  return n;
+}
+
+/* Jni.warmup(path, background = false) */
+static mrb_value jni_s__warmup(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mpath, mbackground = mrb_false_value();
+  struct jmanifest *mf;
+  FILE *fp;
+  long size;
+  char *line, *next;
+  int lines = 0, i;
+
+  mrb_get_args(mrb, "S|o", &mpath, &mbackground);
+  if (ctx->manifest) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: a warmup manifest is already loaded");
+  }
+  fp = fopen(mrb_string_value_cstr(mrb, &mpath), "rb");
+  if (!fp) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: can't open manifest %S: %S", mpath, mrb_str_new_cstr(mrb, strerror(errno)));
+  }
+  mf = (struct jmanifest *)calloc(1, sizeof(struct jmanifest));
+  if (!mf) {
+    fclose(fp);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: can't allocate manifest %S", mpath);
+  }
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  mf->buf = (char *)malloc(size + 1);
+  if (!mf->buf || fread(mf->buf, 1, size, fp) != (size_t)size) {
+    fclose(fp);
+    free(mf->buf);
+    free(mf);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: can't read manifest %S", mpath);
+  }
+  fclose(fp);
+  mf->buf[size] = '\0';
+  for (i = 0; i < size; i++) {
+    if (mf->buf[i] == '\n') {
+      lines++;
+    }
+  }
+  mf->classes = (struct jmanifest_class *)calloc(lines + 1, sizeof(struct jmanifest_class));
+  mf->methods = (struct jmanifest_method *)calloc(lines + 1, sizeof(struct jmanifest_method));
+  if (!mf->classes || !mf->methods) {
+    free(mf->classes);
+    free(mf->methods);
+    free(mf->buf);
+    free(mf);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: can't allocate manifest %S", mpath);
+  }
+  pthread_mutex_init(&mf->lock, NULL);
+  mf->vm = ctx->vm;
+  ctx->manifest = mf;
+
+  for (line = mf->buf; *line; line = next) {
+    char *fields[8];
+    int n;
+
+    next = strchr(line, '\n');
+    if (next) {
+      *next++ = '\0';
+    } else {
+      next = line + strlen(line);
+    }
+    n = jmanifest_split(line, fields, 8);
+    if (n == 2 && strcmp(fields[0], "C") == 0) {
+      mf->classes[mf->nclasses++].path = fields[1];
+    } else if (n == 8 && strcmp(fields[0], "M") == 0) {
+      struct jmanifest_method *meth = mf->methods + mf->nmethods++;
+
+      meth->key = fields[1];
+      meth->path = fields[2];
+      meth->is_static = fields[3][0] == '1';
+      meth->name = fields[4];
+      meth->sig = fields[5];
+      meth->types = fields[6];
+      meth->rtype = fields[7][0] == '-' ? 0 : fields[7][0];
+    }
+  }
+  qsort(mf->classes, mf->nclasses, sizeof(struct jmanifest_class), jmanifest_class_cmp);
+  qsort(mf->methods, mf->nmethods, sizeof(struct jmanifest_method), jmanifest_method_cmp);
+  for (i = 0; i < mf->nmethods; i++) {
+    mf->methods[i].klass = jmanifest_find_class(mf, mf->methods[i].path);
+  }
+
+  /* without the caller's class loader, resolve here rather than miss application classes */
+  if (mrb_test(mbackground) && jmanifest_capture_loader(jni_env(mrb), mf) &&
+      pthread_create(&mf->thread, NULL, jmanifest_thread, mf) == 0) {
+    mf->threaded = 1;
+  } else {
+    jmanifest_resolve(jni_env(mrb), mf);
+  }
+  return mrb_fixnum_value(mf->nclasses + mf->nmethods);
+}
+
+static mrb_value jni_s__set_manifest_record(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mflag, mlog;
+  mrb_sym sym = mrb_intern_cstr(mrb, "__manifest__");
+
+  mrb_get_args(mrb, "o", &mflag);
+  ctx->manifest_recording = mrb_test(mflag);
+  mlog = mrb_iv_get(mrb, self, sym);
+  if (ctx->manifest_recording && mrb_nil_p(mlog)) {
+    mrb_iv_set(mrb, self, sym, mrb_str_new(mrb, "", 0));
+  }
+  return mflag;
+}
+
+static mrb_value jni_s__save_manifest(mrb_state *mrb, mrb_value self) {
+  mrb_value mpath, mlog = mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "__manifest__"));
+  FILE *fp;
+  size_t written;
+
+  mrb_get_args(mrb, "S", &mpath);
+  if (mrb_type(mlog) != MRB_TT_STRING) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: nothing recorded (set Jni.manifest_record = true first)");
+  }
+  fp = fopen(mrb_string_value_cstr(mrb, &mpath), "wb");
+  if (!fp) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: can't write manifest %S: %S", mpath, mrb_str_new_cstr(mrb, strerror(errno)));
+  }
+  written = fwrite(RSTRING_PTR(mlog), 1, RSTRING_LEN(mlog), fp);
+  fclose(fp);
+  if (written != (size_t)RSTRING_LEN(mlog)) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: short write to manifest %S", mpath);
+  }
+  return mrb_fixnum_value(written);
+}
+
+static mrb_value jni_s__warmup_stats(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  struct jmanifest *mf = ctx->manifest;
+  mrb_value mhash = mrb_hash_new(mrb);
+  int i, resolved = 0;
+
+  if (!mf) {
+    return mrb_nil_value();
+  }
+  pthread_mutex_lock(&mf->lock);
+  for (i = 0; i < mf->nclasses; i++) {
+    resolved += mf->classes[i].state == 1;
+  }
+  for (i = 0; i < mf->nmethods; i++) {
+    resolved += mf->methods[i].state == 1;
+  }
+  pthread_mutex_unlock(&mf->lock);
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "classes")), mrb_fixnum_value(mf->nclasses));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "methods")), mrb_fixnum_value(mf->nmethods));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "resolved")), mrb_fixnum_value(resolved));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "hits")), mrb_fixnum_value(mf->hits));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "misses")), mrb_fixnum_value(mf->misses));
+  return mhash;
+}
+
+static mrb_value jdefinition__set_class_path(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mobj, mpath;
+  char *cpath;
+  jclass jclazz, jglobal;
+  JNIEnv* env = jni_env(mrb);
+
+  mrb_get_args(mrb, "o", &mpath);
+  cpath = mrb_string_value_cstr(mrb, &mpath);
+  jglobal = jmanifest_class_ref(mrb, cpath);
+  if (!jglobal) {
+    jclazz = (*env)->FindClass(env, cpath);
+    if ((*env)->ExceptionCheck(env)) {
+      mrb_raisef(mrb, E_NAME_ERROR, "Jni: can't get %S", mpath);
+    }
+    jglobal = (*env)->NewGlobalRef(env, jclazz);
+    (*env)->DeleteLocalRef(env, jclazz);
+  }
+
+  mobj = mrb_obj_value(Data_Wrap_Struct(mrb, mrb->object_class, &jobj_data_type, (void*)jglobal));
+  mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, "jclass"), mobj);
+  jref_created(mrb, jglobal, mrb_class_ptr(self), JREF_CLASS_PATH);
+  mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, "jclass_path"), mpath);
+  if (ctx->manifest_recording) {
+    const char *fields[2] = { "C", cpath };
+
+    jmanifest_log(mrb, fields, 2);
+  }
+  return mpath;
+}
+
+int mrb_mruby_jni_check_jexc(mrb_state *mrb) {
+  JNIEnv* env = jni_env(mrb);
+
+  if ((*env)->ExceptionCheck(env)) {
+    return 1;
+    //mrb_raisef(mrb, E_RUNTIME_ERROR, "Java error TODO: show more detail");
+  }
+  return 0;
+}
+
+static mrb_value jobj_wrap_global(mrb_state *mrb, struct RClass *klass, jobject jobj) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mobj;
+  JNIEnv* env = jni_env(mrb);
+  jobject jglobal;
+  jint hash = 0;
+
+  if (ctx->idmap && jobj) {
+    struct RData *wrapper;
+
+    hash = jni_identity_hash(mrb, jobj);
+    wrapper = jidmap_get(mrb, klass, jobj, hash);
+    if (wrapper) {
+      (*env)->DeleteLocalRef(env, jobj);
+      return mrb_obj_value(wrapper);
+    }
+  }
+  jglobal = (*env)->NewGlobalRef(env, jobj);
+  mobj = mrb_obj_value(Data_Wrap_Struct(mrb, klass, &jobj_data_type, (void*)jglobal));
+  (*env)->DeleteLocalRef(env, jobj);
+  JSTATS_ADD(mrb, transitions, 2);
+  JSTATS_ADD(mrb, global_refs, 1);
+  if (ctx->idmap && jglobal) {
+    jidmap_put(mrb, mobj, hash);
+  }
+  jref_created(mrb, jglobal, klass, JREF_WRAP);
+  return mobj;
+}
+
+static mrb_value jni_local_scopes(mrb_state *mrb) {
+  struct RClass *mod = mrb_module_get(mrb, "Jni");
+
+  return mrb_iv_get(mrb, mrb_obj_value(mod), mrb_intern_cstr(mrb, "__local_scopes__"));
+}
+
+mrb_value mrb_mruby_jni_wrap_jobject(mrb_state *mrb, struct RClass *klass, jobject jobj) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mobj, mscopes;
+
+  if (!ctx->scope_depth) {
+    return jobj_wrap_global(mrb, klass, jobj);
+  }
+  if (ctx->idmap && jobj) {
+    /* reuse a global wrapper; local wrappers are not mapped */
+    struct RData *wrapper = jidmap_get(mrb, klass, jobj, jni_identity_hash(mrb, jobj));
+
+    if (wrapper) {
+      return mrb_obj_value(wrapper);
+    }
+  }
+  mobj = mrb_obj_value(Data_Wrap_Struct(mrb, klass, &jobj_local_data_type, (void*)jobj));
+  mscopes = jni_local_scopes(mrb);
+  mrb_ary_push(mrb, RARRAY_PTR(mscopes)[RARRAY_LEN(mscopes) - 1], mobj);
+  return mobj;
+}
+
+static void jobj_promote(mrb_state *mrb, mrb_value mobj) {
+  JNIEnv* env = jni_env(mrb);
+
+  if (mrb_type(mobj) != MRB_TT_DATA || DATA_TYPE(mobj) != &jobj_local_data_type) {
+    return;
+  }
+  if (DATA_PTR(mobj)) {
+    DATA_PTR(mobj) = (*env)->NewGlobalRef(env, (jobject)DATA_PTR(mobj));
+  }
+  DATA_TYPE(mobj) = &jobj_data_type;
+  jref_created(mrb, (jobject)DATA_PTR(mobj), mrb_obj_class(mrb, mobj), JREF_WRAP);
+}
+
+struct RJMethod;
+
+typedef mrb_value (*caller_t)(mrb_state*, mrb_value, struct RJMethod*, jvalue*);
+
+/* argument marshalling plan, compiled once from the types string */
+enum jarg_op {
+  JARG_NONE,
+  JARG_BOOL,
+  JARG_BYTE,
+  JARG_CHAR,
+  JARG_SHORT,
+  JARG_INT,
+  JARG_LONG,
+  JARG_FLOAT,
+  JARG_DOUBLE,
+  JARG_STR,
+  JARG_OBJ,
+  JARG_ARY,
+};
+
+struct RJArg {
+  enum jarg_op op;
+  const char *cname; /* JARG_OBJ: class name inside RJMethod.types */
+  int clen;
+  int resolved; /* JARG_OBJ: klass/jclazz below are filled */
+  struct RClass *klass; /* JARG_OBJ: mruby class bound to cname, if any */
+  jclass jclazz; /* JARG_OBJ: global ref used when klass is NULL,
+                    JARG_ARY: element class of reference arrays */
+  struct RJArg *elem; /* JARG_ARY: element plan */
+};
+
+struct RJMethod {
+  jmethodID id;
+  jclass jclazz;
+  caller_t caller;
+  union opt1 {
+    struct RClass *klass;
+  } opt1;
+  union opt2 {
+    int depth;
+  } opt2;
+  int argc;
+  int needs_receiver; /* instance method: self must hold a Java object */
+  int is_static;
+  int nonvirtual; /* instance method called without virtual dispatch */
+  int array_view; /* array return wrapped in a Jni::Array */
+  char rtype; /* return type from class2type, 0 for constructors */
+  struct RJArg *args;
+  char *types;
+#if MRUBY_JNI_STATS
+  struct jmeth_stats stats;
+#endif
+};
+
+static void jarg_free(mrb_state *mrb, struct RJArg *arg) {
+  JNIEnv* env = jni_env(mrb);
+
+  if (arg->jclazz) {
+    (*env)->DeleteGlobalRef(env, arg->jclazz);
+  }
+  if (arg->elem) {
+    jarg_free(mrb, arg->elem);
+    free(arg->elem);
+  }
+}
+
+static void jmeth_free(mrb_state *mrb, void *p) {
+  struct RJMethod *smeth = (struct RJMethod *)p;
+  int i;
+
+  if (smeth->args) {
+    for (i = 0; i < smeth->argc; i++) {
+      jarg_free(mrb, smeth->args + i);
+    }
+    free(smeth->args);
+  }
+  if (smeth->types) {
+    free(smeth->types);
+  }
+#if MRUBY_JNI_STATS
+  {
+    struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+
+    if (ctx && ctx->stats_cur == &smeth->stats) {
+      ctx->stats_cur = NULL;
+    }
+    smeth->stats.prev->next = smeth->stats.next;
+    smeth->stats.next->prev = smeth->stats.prev;
+    free(smeth->stats.label);
+  }
+#endif
+  free(p);
+}
+
+static const struct mrb_data_type jmeth_data_type = {
+  "jmethod", jmeth_free,
+};
+
+/* Jni::Long: a Java long that doesn't fit in a Fixnum */
+#define JLONG_INLINE (sizeof(void*) >= sizeof(jlong))
+
+static void jlong_free(mrb_state *mrb, void *p) {
+  if (!JLONG_INLINE) {
+    free(p);
+  }
+}
+
+static const struct mrb_data_type jlong_data_type = {
+  "jlong", jlong_free,
+};
+
+static void *jlong_pack(jlong jl) {
+  jlong *pl;
+
+  if (JLONG_INLINE) {
+    return (void*)(intptr_t)jl;
+  }
+  pl = (jlong *)malloc(sizeof(jlong));
+  *pl = jl;
+  return pl;
+}
+
+static inline jlong jlong_unpack(void *p) {
+  if (JLONG_INLINE) {
+    return (jlong)(intptr_t)p;
+  }
+  return *(jlong *)p;
+}
+
+static mrb_value jlong2mlong(mrb_state *mrb, jlong jl) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+
+  if (jl >= MRB_INT_MIN && jl <= MRB_INT_MAX) {
+    return mrb_fixnum_value((mrb_int)jl);
+  }
+  return mrb_obj_value(Data_Wrap_Struct(mrb, ctx->long_class, &jlong_data_type, jlong_pack(jl)));
+}
+
+static int mlong2jlong(mrb_state *mrb, mrb_value mobj, jlong *pl) {
+  switch (mrb_type(mobj)) {
+    case MRB_TT_FIXNUM: {
+      *pl = mrb_fixnum(mobj);
+    } break;
+    case MRB_TT_DATA: {
+      if (DATA_TYPE(mobj) != &jlong_data_type) {
+        return 0;
+      }
+      *pl = jlong_unpack(DATA_PTR(mobj));
+    } break;
+    default: {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static mrb_value jlong__initialize(mrb_state *mrb, mrb_value self) {
+  mrb_value mval, mlo;
+  jlong jl;
+  int argc;
+
+  DATA_TYPE(self) = &jlong_data_type;
+  DATA_PTR(self) = jlong_pack(0);
+  argc = mrb_get_args(mrb, "o|o", &mval, &mlo);
+  if (argc == 2) { /* high and low 32 bits */
+    jl = (jlong)(((unsigned long long)(unsigned int)mrb_fixnum(mval) << 32) | (unsigned int)mrb_fixnum(mlo));
+  } else if (mrb_type(mval) == MRB_TT_STRING) {
+    char *cstr = mrb_string_value_cstr(mrb, &mval);
+    char *cend;
+
+    errno = 0;
+    jl = strtoll(cstr, &cend, 10);
+    if (errno || *cend || cend == cstr) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "Jni: invalid long: %S", mval);
+    }
+  } else if (!mlong2jlong(mrb, mval, &jl)) {
+    mrb_raisef(mrb, E_TYPE_ERROR, "Jni: can't convert %S to long", mrb_inspect(mrb, mval));
+  }
+  jlong_free(mrb, DATA_PTR(self));
+  DATA_PTR(self) = jlong_pack(jl);
+  return self;
+}
+
+static mrb_value jlong__to_s(mrb_state *mrb, mrb_value self) {
+  char buf[24];
+
+  snprintf(buf, sizeof(buf), "%lld", (long long)jlong_unpack(DATA_PTR(self)));
+  return mrb_str_new_cstr(mrb, buf);
+}
+
+static mrb_value jlong__to_f(mrb_state *mrb, mrb_value self) {
+  return mrb_float_value(mrb, (mrb_float)jlong_unpack(DATA_PTR(self)));
+}
+
+static mrb_value jlong__hi(mrb_state *mrb, mrb_value self) {
+  unsigned long long bits = (unsigned long long)jlong_unpack(DATA_PTR(self));
+
+  return mrb_fixnum_value((int)(bits>>32));
+}
+
+static mrb_value jlong__lo(mrb_state *mrb, mrb_value self) {
+  unsigned long long bits = (unsigned long long)jlong_unpack(DATA_PTR(self));
+
+  return mrb_fixnum_value((int)((bits<<32)>>32));
+}
+
+static mrb_value jlong__cmp(mrb_state *mrb, mrb_value self) {
+  mrb_value mother;
+  jlong jl, jother;
+
+  mrb_get_args(mrb, "o", &mother);
+  if (!mlong2jlong(mrb, mother, &jother)) {
+    return mrb_nil_value();
+  }
+  jl = jlong_unpack(DATA_PTR(self));
+  return mrb_fixnum_value(jl < jother ? -1 : jl > jother ? 1 : 0);
+}
+
+static mrb_value jlong__eq(mrb_state *mrb, mrb_value self) {
+  mrb_value mother;
+  jlong jother;
+
+  mrb_get_args(mrb, "o", &mother);
+  if (!mlong2jlong(mrb, mother, &jother)) {
+    return mrb_false_value();
+  }
+  return mrb_bool_value(jlong_unpack(DATA_PTR(self)) == jother);
+}
+
+static mrb_value jlong__hash(mrb_state *mrb, mrb_value self) {
+  unsigned long long bits = (unsigned long long)jlong_unpack(DATA_PTR(self));
+
+  return mrb_fixnum_value((mrb_int)(bits ^ (bits >> 32)) & MRB_INT_MAX);
+}
+
+/* UTF-8 <-> UTF-16; bad input becomes U+FFFD, a NULL dst only measures */
+#define JSTR_INLINE 256
+
+static size_t utf16_to_utf8(const jchar *src, jsize len, char *dst) {
+  size_t n = 0;
+  jsize i;
+
+  for (i = 0; i < len; i++) {
+    unsigned long c = src[i];
+
+    if (c >= 0xD800 && c <= 0xDBFF && i + 1 < len && src[i + 1] >= 0xDC00 && src[i + 1] <= 0xDFFF) {
+      c = 0x10000 + ((c - 0xD800) << 10) + (src[++i] - 0xDC00);
+    } else if (c >= 0xD800 && c <= 0xDFFF) {
+      c = 0xFFFD;
+    }
+    if (c < 0x80) {
+      if (dst) {
+        dst[n] = (char)c;
+      }
+      n += 1;
+    } else if (c < 0x800) {
+      if (dst) {
+        dst[n] = (char)(0xC0 | (c >> 6));
+        dst[n + 1] = (char)(0x80 | (c & 0x3F));
+      }
+      n += 2;
+    } else if (c < 0x10000) {
+      if (dst) {
+        dst[n] = (char)(0xE0 | (c >> 12));
+        dst[n + 1] = (char)(0x80 | ((c >> 6) & 0x3F));
+        dst[n + 2] = (char)(0x80 | (c & 0x3F));
+      }
+      n += 3;
+    } else {
+      if (dst) {
+        dst[n] = (char)(0xF0 | (c >> 18));
+        dst[n + 1] = (char)(0x80 | ((c >> 12) & 0x3F));
+        dst[n + 2] = (char)(0x80 | ((c >> 6) & 0x3F));
+        dst[n + 3] = (char)(0x80 | (c & 0x3F));
+      }
+      n += 4;
+    }
+  }
+  return n;
+}
+
+static jsize utf8_to_utf16(const unsigned char *src, size_t len, jchar *dst) {
+  jsize n = 0;
+  size_t i = 0;
+
+  while (i < len) {
+    unsigned long c = src[i];
+    int extra, k;
+
+    if (c < 0x80) {
+      extra = 0;
+    } else if ((c & 0xE0) == 0xC0) {
+      extra = 1;
+      c &= 0x1F;
+    } else if ((c & 0xF0) == 0xE0) {
+      extra = 2;
+      c &= 0x0F;
+    } else if ((c & 0xF8) == 0xF0) {
+      extra = 3;
+      c &= 0x07;
+    } else {
+      extra = -1;
+    }
+    for (k = 1; extra > 0 && k <= extra; k++) {
+      if (i + k >= len || (src[i + k] & 0xC0) != 0x80) {
+        extra = -1;
+        break;
+      }
+      c = (c << 6) | (src[i + k] & 0x3F);
+    }
+    if (extra < 0 || (extra == 1 && c < 0x80) || (extra == 2 && c < 0x800) ||
+        (extra == 3 && (c < 0x10000 || c > 0x10FFFF)) || (c >= 0xD800 && c <= 0xDFFF)) {
+      c = 0xFFFD;
+      extra = 0;
+    }
+    i += extra + 1;
+    if (c >= 0x10000) {
+      if (dst) {
+        dst[n] = (jchar)(0xD800 + ((c - 0x10000) >> 10));
+        dst[n + 1] = (jchar)(0xDC00 + ((c - 0x10000) & 0x3FF));
+      }
+      n += 2;
+    } else {
+      if (dst) {
+        dst[n] = (jchar)c;
+      }
+      n += 1;
+    }
+  }
+  return n;
+}
+
+/* Jni.string_cache: short Strings to global jstrings, 4-way set-associative LRU */
+static unsigned int jstr_hash(const char *p, int len) {
+  unsigned int h = 2166136261u;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)p[i]) * 16777619u;
+  }
+  return h;
+}
+
+static jstring mstr2jstr(mrb_state *mrb, mrb_value mstr);
+
+static jstring jstr_cache_get(mrb_state *mrb, mrb_value mstr) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  struct jstr_cache_entry *set, *victim = NULL;
+  const char *p = RSTRING_PTR(mstr);
+  int len = RSTRING_LEN(mstr);
+  unsigned int hash;
+  jstring jstr;
+  int i;
+
+  hash = jstr_hash(p, len);
+  set = ctx->jstr_cache + (hash % ctx->jstr_cache_sets) * JSTR_CACHE_WAYS;
+  for (i = 0; i < JSTR_CACHE_WAYS; i++) {
+    struct jstr_cache_entry *entry = set + i;
+
+    if (entry->jstr && entry->hash == hash && entry->len == len && memcmp(entry->bytes, p, len) == 0) {
+      ctx->jstr_hits++;
+      entry->stamp = ++ctx->jstr_clock;
+      JSTATS_ADD(mrb, transitions, 1);
+      return (jstring)(*env)->NewLocalRef(env, entry->jstr);
+    }
+    if (!victim || (victim->jstr && (!entry->jstr || entry->stamp < victim->stamp))) {
+      victim = entry;
+    }
+  }
+
+  ctx->jstr_misses++;
+  jstr = mstr2jstr(mrb, mstr);
+  if (!jstr) {
+    return NULL;
+  }
+  if (victim->jstr) {
+    (*env)->DeleteGlobalRef(env, victim->jstr);
+    ctx->jstr_evictions++;
+  }
+  victim->jstr = (jstring)(*env)->NewGlobalRef(env, jstr);
+  victim->stamp = ++ctx->jstr_clock;
+  victim->hash = hash;
+  victim->len = len;
+  memcpy(victim->bytes, p, len);
+  return jstr;
+}
+
+static void jstr_cache_clear(mrb_state *mrb) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  int i;
+
+  if (!ctx->jstr_cache) {
+    return;
+  }
+  for (i = 0; i < ctx->jstr_cache_sets * JSTR_CACHE_WAYS; i++) {
+    if (ctx->jstr_cache[i].jstr) {
+      (*env)->DeleteGlobalRef(env, ctx->jstr_cache[i].jstr);
+    }
+  }
+  free(ctx->jstr_cache);
+  ctx->jstr_cache = NULL;
+  ctx->jstr_cache_sets = 0;
+}
+
+static mrb_value jstr2mstr(mrb_state *mrb, jstring jstr) {
+  JNIEnv* env = jni_env(mrb);
+  jchar inline_buf[JSTR_INLINE];
+  jchar *buf = inline_buf;
+  mrb_value mstr;
+  jsize len;
+  size_t size;
+
+  len = (*env)->GetStringLength(env, jstr);
+  if (len > JSTR_INLINE) {
+    mrb_value mtmp = mrb_str_buf_new(mrb, len * sizeof(jchar));
+    buf = (jchar *)RSTRING_PTR(mtmp);
+  }
+  (*env)->GetStringRegion(env, jstr, 0, len, buf);
+  (*env)->DeleteLocalRef(env, jstr);
+  JSTATS_ADD(mrb, transitions, 3);
+  JSTATS_ADD(mrb, strings, 1);
+
+  size = utf16_to_utf8(buf, len, NULL);
+  mstr = mrb_str_buf_new(mrb, size);
+  utf16_to_utf8(buf, len, RSTRING_PTR(mstr));
+  return mrb_str_resize(mrb, mstr, size);
+}
+
+static jstring mstr2jstr(mrb_state *mrb, mrb_value mstr) {
+  JNIEnv* env = jni_env(mrb);
+  jchar inline_buf[JSTR_INLINE];
+  jchar *buf = inline_buf;
+  const unsigned char *src = (const unsigned char *)RSTRING_PTR(mstr);
+  jstring jstr;
+  jsize len;
+
+  len = utf8_to_utf16(src, RSTRING_LEN(mstr), NULL);
+  if (len > JSTR_INLINE) {
+    buf = (jchar *)malloc(len * sizeof(jchar));
+    if (!buf) {
+      return NULL;
+    }
+  }
+  utf8_to_utf16(src, RSTRING_LEN(mstr), buf);
+  jstr = (*env)->NewString(env, buf, len);
+  if (buf != inline_buf) {
+    free(buf);
+  }
+  JSTATS_ADD(mrb, transitions, 1);
+  JSTATS_ADD(mrb, strings, 1);
+  return jstr;
+}
+
+static mrb_value jmeth_i__wrap_jclassobj(mrb_state *mrb, mrb_value mobj, jobject jobj, int global) {
+  mrb_value mclassclass;
+  mclassclass = mrb_str_new(mrb, "java.lang.Class", 15);
+  mclassclass = mrb_funcall(mrb, mobj, "name2class", 1, mclassclass);
+  if (global) {
+    return jobj_wrap_global(mrb, mrb_class_ptr(mclassclass), jobj);
+  }
+  return mrb_mruby_jni_wrap_jobject(mrb, mrb_class_ptr(mclassclass), jobj);
+}
+
+/* jclass2mclass cache keyed on identityHashCode and receiver class, direct-mapped */
+static void jclass_cache_init(mrb_state *mrb) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mpin;
+  jclass jclazz;
+  int i;
+
+  ctx->class_cache = (struct jclass_cache_entry *)calloc(JCLASS_CACHE_SIZE, sizeof(struct jclass_cache_entry));
+  if (!ctx->class_cache) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: can't allocate class cache");
+  }
+  jni_identity_init(mrb);
+  jclazz = (*env)->FindClass(env, "java/lang/Class");
+  ctx->class_get_name = (*env)->GetMethodID(env, jclazz, "getName", "()Ljava/lang/String;");
+  (*env)->DeleteLocalRef(env, jclazz);
+
+  mpin = mrb_ary_new_capa(mrb, JCLASS_CACHE_SIZE);
+  for (i = 0; i < JCLASS_CACHE_SIZE; i++) {
+    mrb_ary_push(mrb, mpin, mrb_nil_value());
+  }
+  mrb_iv_set(mrb, mrb_obj_value(mrb_module_get(mrb, "Jni")), mrb_intern_cstr(mrb, "__class_cache__"), mpin);
+  ctx->class_pin = mrb_ary_ptr(mpin);
+}
+
+static void jclass_cache_clear(mrb_state *mrb) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  int i;
+
+  if (!ctx->class_cache) {
+    return;
+  }
+  for (i = 0; i < JCLASS_CACHE_SIZE; i++) {
+    if (ctx->class_cache[i].jclazz) {
+      jref_untrack(ctx, ctx->class_cache[i].jclazz);
+      (*env)->DeleteGlobalRef(env, ctx->class_cache[i].jclazz);
+    }
+  }
+  free(ctx->class_cache);
+  ctx->class_cache = NULL;
+  ctx->class_pin = NULL;
+}
+
+mrb_value mrb_mruby_jni_jclass2mclass(mrb_state *mrb, jobject jobj, mrb_value mobj) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  struct jclass_cache_entry *entry;
+  struct RClass *recv;
+  jstring jname;
+  mrb_value mret, mclass, mname, mclassobj;
+  const char *cname;
+  jsize size;
+  jint hash;
+
+  if (!jobj) {
+    return mrb_nil_value();
+  }
+  if (!ctx->class_cache) {
+    jclass_cache_init(mrb);
+  }
+  recv = mrb_obj_class(mrb, mobj);
+  hash = (*env)->CallStaticIntMethod(env, ctx->system_class, ctx->identity_hash, jobj);
+  entry = ctx->class_cache + (((unsigned int)hash ^ (unsigned int)((uintptr_t)recv >> 4)) & (JCLASS_CACHE_SIZE - 1));
+  if (entry->jclazz && entry->hash == hash && entry->recv == recv && (*env)->IsSameObject(env, entry->jclazz, jobj)) {
+    (*env)->DeleteLocalRef(env, jobj);
+    return ctx->class_pin->ptr[entry - ctx->class_cache];
+  }
+
+  jname = (*env)->CallObjectMethod(env, jobj, ctx->class_get_name);
+  size = (*env)->GetStringUTFLength(env, jname);
+  cname = (*env)->GetStringUTFChars(env, jname, NULL);
+  mname = mrb_str_new(mrb, cname, size);
+  (*env)->ReleaseStringUTFChars(env, jname, cname);
+  (*env)->DeleteLocalRef(env, jname);
+
+  mret = mclass = mrb_funcall(mrb, mobj, "name2class", 1, mname);
+  while (mrb_type(mclass) == MRB_TT_ARRAY) {
+    mclass = mrb_ary_ref(mrb, mclass, 0);
+  }
+  if (mrb_nil_p(mclass)) {
+    return jmeth_i__wrap_jclassobj(mrb, mobj, jobj, 0);
+  }
+  mclassobj = mrb_iv_get(mrb, mclass, mrb_intern_cstr(mrb, "@jclassobj"));
+  if (mrb_nil_p(mclassobj)) {
+    mclassobj = jmeth_i__wrap_jclassobj(mrb, mobj, (*env)->NewLocalRef(env, jobj), 1);
+    mrb_iv_set(mrb, mclass, mrb_intern_cstr(mrb, "@jclassobj"), mclassobj);
+  }
+
+  if (entry->jclazz) {
+    jref_untrack(ctx, entry->jclazz);
+    (*env)->DeleteGlobalRef(env, entry->jclazz);
+  }
+  entry->jclazz = (jclass)(*env)->NewGlobalRef(env, jobj);
+  jref_created(mrb, entry->jclazz, mrb_type(mret) == MRB_TT_CLASS ? mrb_class_ptr(mret) : NULL, JREF_CLASS_CACHE);
+  entry->hash = hash;
+  entry->recv = recv;
+  mrb_ary_set(mrb, mrb_obj_value(ctx->class_pin), entry - ctx->class_cache, mret);
+  (*env)->DeleteLocalRef(env, jobj);
+  return mret;
+}
+
+/* callers per return type and dispatch kind (instance, static, nonvirtual) */
+enum jcall_kind {
+  JCALL_INSTANCE,
+  JCALL_STATIC,
+  JCALL_NONVIRTUAL,
+  JCALL_KINDS,
+};
+
+#define JMETH_INVOKE(jname, kind) JMETH_INVOKE_##kind(jname)
+#define JMETH_INVOKE_instance(jname) \
+  (*env)->Call##jname##MethodA(env, (jobject)DATA_PTR(mobj), rmeth->id, argv)
+#define JMETH_INVOKE_static(jname) \
+  (*env)->CallStatic##jname##MethodA(env, rmeth->jclazz, rmeth->id, argv)
+#define JMETH_INVOKE_nonvirtual(jname) \
+  (*env)->CallNonvirtual##jname##MethodA(env, (jobject)DATA_PTR(mobj), rmeth->jclazz, rmeth->id, argv)
+
+#define JMETH_CALLER(name, suffix, kind, jtype, jname, to_mrb) \
+static mrb_value jmeth_i__call_##name##suffix(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth, jvalue *argv) { \
+  JNIEnv* env = jni_env(mrb); \
+  jtype jv = JMETH_INVOKE(jname, kind); \
+  return to_mrb; \
+}
+#define JMETH_CALLERS(name, jtype, jname, to_mrb) \
+  JMETH_CALLER(name, , instance, jtype, jname, to_mrb) \
+  JMETH_CALLER(name, _static, static, jtype, jname, to_mrb) \
+  JMETH_CALLER(name, _nonvirtual, nonvirtual, jtype, jname, to_mrb)
+
+#define JMETH_VOID_CALLER(suffix, kind) \
+static mrb_value jmeth_i__call_void##suffix(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth, jvalue *argv) { \
+  JNIEnv* env = jni_env(mrb); \
+  JMETH_INVOKE(Void, kind); \
+  return mobj; \
+}
+
+static mrb_value jmeth_jstr2mobj(mrb_state *mrb, jobject jobj) {
+  if (!jobj) {
+    return mrb_nil_value();
+  }
+  return jstr2mstr(mrb, (jstring)jobj);
+}
+
+static mrb_value jmeth_jobj2mobj(mrb_state *mrb, struct RJMethod *rmeth, jobject jobj) {
+  if (!jobj || mrb_mruby_jni_check_jexc(mrb)) {
+    return mrb_nil_value();
+  }
+  return mrb_mruby_jni_wrap_jobject(mrb, rmeth->opt1.klass, jobj);
+}
+
+JMETH_VOID_CALLER(, instance)
+JMETH_VOID_CALLER(_static, static)
+JMETH_VOID_CALLER(_nonvirtual, nonvirtual)
+JMETH_CALLERS(bool, jboolean, Boolean, mrb_bool_value(jv))
+JMETH_CALLERS(byte, jbyte, Byte, mrb_fixnum_value(jv))
+JMETH_CALLERS(char, jchar, Char, mrb_fixnum_value(jv))
+JMETH_CALLERS(short, jshort, Short, mrb_fixnum_value(jv))
+JMETH_CALLERS(int, jint, Int, mrb_fixnum_value(jv))
+JMETH_CALLERS(long, jlong, Long, jlong2mlong(mrb, jv))
+JMETH_CALLERS(float, jfloat, Float, mrb_float_value(mrb, jv))
+JMETH_CALLERS(double, jdouble, Double, mrb_float_value(mrb, jv))
+JMETH_CALLERS(str, jobject, Object, jmeth_jstr2mobj(mrb, jv))
+JMETH_CALLERS(class, jobject, Object, mrb_mruby_jni_jclass2mclass(mrb, jv, mobj))
+JMETH_CALLERS(obj, jobject, Object, jmeth_jobj2mobj(mrb, rmeth, jv))
+
+static mrb_value jmeth_i__call_constructor(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth, jvalue *argv) {
+  JNIEnv* env = jni_env(mrb);
+  jobject jobj;
+
+  DATA_TYPE(mobj) = &jobj_data_type;
+  DATA_PTR(mobj) = NULL;
+
+  jobj = (*env)->NewObjectA(env, rmeth->jclazz, rmeth->id, argv);
+  if (jobj) {
+    DATA_PTR(mobj) = (*env)->NewGlobalRef(env, jobj);
+    (*env)->DeleteLocalRef(env, jobj);
+    JSTATS_ADD(mrb, transitions, 2);
+    JSTATS_ADD(mrb, global_refs, 1);
+    if (((struct mrb_jni_context *)mrb->ud)->idmap) {
+      jidmap_put(mrb, mobj, jni_identity_hash(mrb, (jobject)DATA_PTR(mobj)));
+    }
+    jref_created(mrb, (jobject)DATA_PTR(mobj), mrb_obj_class(mrb, mobj), JREF_CONSTRUCTOR);
+  } else if (!(*env)->ExceptionCheck(env)) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "constructor returns null");
+  }
+  return mobj;
+}
+
+/* Jni::Array: a returned Java array converted on access */
+#define JARY_CHUNK 256
+
+struct RJArray {
+  jarray jary;
+  jsize len;
+  char etype;
+  struct RClass *klass; /* element class of object arrays */
+};
+
+static void jary_free(mrb_state *mrb, void *p) {
+  struct RJArray *sary = (struct RJArray *)p;
+
+  jobj_free(mrb, sary->jary);
+  free(p);
+}
+
+static const struct mrb_data_type jary_data_type = {
+  "jarray", jary_free,
+};
+
+static int jary_supported(char etype) {
+  return etype && strchr("ZBCSIJFDLsc", etype) != NULL;
+}
+
+/* byte[] comes back as a binary String, copied with one region read */
+static mrb_value jbytes2mstr(mrb_state *mrb, jbyteArray jary) {
+  JNIEnv* env = jni_env(mrb);
+  jsize len = (*env)->GetArrayLength(env, jary);
+  mrb_value mstr = mrb_str_buf_new(mrb, len);
+
+  (*env)->GetByteArrayRegion(env, jary, 0, len, (jbyte *)RSTRING_PTR(mstr));
+  JSTATS_ADD(mrb, transitions, 2);
+  return mrb_str_resize(mrb, mstr, len);
+}
+
+/* convert elements [start, start + len) into mdst, or yield them to mblk */
+static void jary_convert(mrb_state *mrb, jarray jary, char etype, int depth, struct RClass *klass, mrb_value mrecv,
+                         jsize start, jsize len, mrb_value mdst, mrb_value mblk) {
+  JNIEnv* env = jni_env(mrb);
+  union {
+    jboolean z[JARY_CHUNK];
+    jbyte b[JARY_CHUNK];
+    jchar c[JARY_CHUNK];
+    jshort s[JARY_CHUNK];
+    jint i[JARY_CHUNK];
+    jlong j[JARY_CHUNK];
+    jfloat f[JARY_CHUNK];
+    jdouble d[JARY_CHUNK];
+  } buf;
+  jsize pos, n, i;
+  int ai;
+
+  for (pos = start; pos < start + len; pos += n) {
+    n = start + len - pos;
+    if (n > JARY_CHUNK) {
+      n = JARY_CHUNK;
+    }
+    if (depth == 1) {
+      switch (etype) {
+        case 'Z': (*env)->GetBooleanArrayRegion(env, jary, pos, n, buf.z); break;
+        case 'B': (*env)->GetByteArrayRegion(env, jary, pos, n, buf.b); break;
+        case 'C': (*env)->GetCharArrayRegion(env, jary, pos, n, buf.c); break;
+        case 'S': (*env)->GetShortArrayRegion(env, jary, pos, n, buf.s); break;
+        case 'I': (*env)->GetIntArrayRegion(env, jary, pos, n, buf.i); break;
+        case 'J': (*env)->GetLongArrayRegion(env, jary, pos, n, buf.j); break;
+        case 'F': (*env)->GetFloatArrayRegion(env, jary, pos, n, buf.f); break;
+        case 'D': (*env)->GetDoubleArrayRegion(env, jary, pos, n, buf.d); break;
+      }
+      JSTATS_ADD(mrb, transitions, 1);
+    }
+    ai = mrb_gc_arena_save(mrb);
+    for (i = 0; i < n; i++) {
+      mrb_value mitem;
+
+      switch (depth == 1 ? etype : '[') {
+        case 'Z': mitem = mrb_bool_value(buf.z[i]); break;
+        case 'B': mitem = mrb_fixnum_value(buf.b[i]); break;
+        case 'C': mitem = mrb_fixnum_value(buf.c[i]); break;
+        case 'S': mitem = mrb_fixnum_value(buf.s[i]); break;
+        case 'I': mitem = mrb_fixnum_value(buf.i[i]); break;
+        case 'J': mitem = jlong2mlong(mrb, buf.j[i]); break;
+        case 'F': mitem = mrb_float_value(mrb, buf.f[i]); break;
+        case 'D': mitem = mrb_float_value(mrb, buf.d[i]); break;
+        default: {
+          jobject jobj = (*env)->GetObjectArrayElement(env, jary, pos + i);
+
+          JSTATS_ADD(mrb, transitions, 1);
+          if (!jobj) {
+            mitem = mrb_nil_value();
+          } else if (depth == 2 && etype == 'B') {
+            mitem = jbytes2mstr(mrb, jobj);
+            (*env)->DeleteLocalRef(env, jobj);
+          } else if (depth > 1) {
+            jsize sublen = (*env)->GetArrayLength(env, jobj);
+
+            mitem = mrb_ary_new_capa(mrb, sublen);
+            jary_convert(mrb, jobj, etype, depth - 1, klass, mrecv, 0, sublen, mitem, mrb_nil_value());
+            (*env)->DeleteLocalRef(env, jobj);
+          } else if (etype == 's') {
+            mitem = jstr2mstr(mrb, jobj);
+          } else if (etype == 'c') {
+            mitem = mrb_mruby_jni_jclass2mclass(mrb, jobj, mrecv);
+          } else {
+            mitem = mrb_mruby_jni_wrap_jobject(mrb, klass, jobj);
+          }
+        } break;
+      }
+      if (mrb_nil_p(mblk)) {
+        mrb_ary_push(mrb, mdst, mitem);
+      } else {
+        mrb_yield(mrb, mblk, mitem);
+      }
+      mrb_gc_arena_restore(mrb, ai);
+    }
+  }
+}
+
+static void jary_each(mrb_state *mrb, mrb_value self, jsize start, jsize len, mrb_value mdst, mrb_value mblk) {
+  struct RJArray *sary = DATA_PTR(self);
+  mrb_value mrecv = mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "receiver"));
+
+  jary_convert(mrb, sary->jary, sary->etype, 1, sary->klass, mrecv, start, len, mdst, mblk);
+}
+
+static mrb_value jary__size(mrb_state *mrb, mrb_value self) {
+  struct RJArray *sary = DATA_PTR(self);
+
+  return mrb_fixnum_value(sary->len);
+}
+
+static mrb_value jary__aref(mrb_state *mrb, mrb_value self) {
+  struct RJArray *sary = DATA_PTR(self);
+  mrb_int start, len;
+  mrb_value mary;
+  int argc;
+
+  argc = mrb_get_args(mrb, "i|i", &start, &len);
+  if (start < 0) {
+    start += sary->len;
+  }
+  if (argc == 1) {
+    if (start < 0 || start >= sary->len) {
+      return mrb_nil_value();
+    }
+    len = 1;
+  } else {
+    if (start < 0 || start > sary->len || len < 0) {
+      return mrb_nil_value();
+    }
+    if (len > sary->len - start) {
+      len = sary->len - start;
+    }
+  }
+  mary = mrb_ary_new_capa(mrb, len);
+  jary_each(mrb, self, start, len, mary, mrb_nil_value());
+  if (argc == 1) {
+    return RARRAY_PTR(mary)[0];
+  }
+  return mary;
+}
+
+static mrb_value jary__to_a(mrb_state *mrb, mrb_value self) {
+  struct RJArray *sary = DATA_PTR(self);
+  mrb_value mary = mrb_ary_new_capa(mrb, sary->len);
+
+  jary_each(mrb, self, 0, sary->len, mary, mrb_nil_value());
+  return mary;
+}
+
+static mrb_value jary__each(mrb_state *mrb, mrb_value self) {
+  struct RJArray *sary = DATA_PTR(self);
+  mrb_value mblk;
+
+  mrb_get_args(mrb, "&", &mblk);
+  if (mrb_nil_p(mblk)) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "Jni: no block given");
+  }
+  jary_each(mrb, self, 0, sary->len, mrb_nil_value(), mblk);
+  return self;
+}
+
+static mrb_value jmeth_jary2mobj(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth, jarray jary) {
+  JNIEnv* env = jni_env(mrb);
+  mrb_value mary;
+  jsize len;
+
+  if (!jary) {
+    return mrb_nil_value();
+  }
+  if (rmeth->rtype == 'B' && rmeth->opt2.depth == 1) {
+    mary = jbytes2mstr(mrb, jary);
+    (*env)->DeleteLocalRef(env, jary);
+    return mary;
+  }
+  len = (*env)->GetArrayLength(env, jary);
+  mary = mrb_ary_new_capa(mrb, len);
+  jary_convert(mrb, jary, rmeth->rtype, rmeth->opt2.depth, rmeth->opt1.klass, mobj, 0, len, mary, mrb_nil_value());
+  (*env)->DeleteLocalRef(env, jary);
+  return mary;
+}
+
+static mrb_value jmeth_jary2view(mrb_state *mrb, mrb_value mobj, struct RJMethod *rmeth, jarray jary) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  struct RJArray *sary;
+  mrb_value mview;
+
+  if (!jary) {
+    return mrb_nil_value();
+  }
+  sary = (struct RJArray *)malloc(sizeof(struct RJArray));
+  if (!sary) {
+    (*env)->DeleteLocalRef(env, jary);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: can't allocate an array view");
+  }
+  sary->len = (*env)->GetArrayLength(env, jary);
+  sary->etype = rmeth->rtype;
+  sary->klass = rmeth->opt1.klass;
+  sary->jary = (*env)->NewGlobalRef(env, jary);
+  (*env)->DeleteLocalRef(env, jary);
+  mview = mrb_obj_value(Data_Wrap_Struct(mrb, ctx->array_class, &jary_data_type, sary));
+  jref_created(mrb, sary->jary, ctx->array_class, JREF_ARRAY);
+  if (sary->etype == 'c') {
+    mrb_iv_set(mrb, mview, mrb_intern_cstr(mrb, "receiver"), mobj);
+  }
+  return mview;
+}
+
+/* element conversion is driven by rmeth->rtype, so arrays only vary in dispatch */
+JMETH_CALLERS(ary, jobject, Object, jmeth_jary2mobj(mrb, mobj, rmeth, (jarray)jv))
+JMETH_CALLERS(ary_view, jobject, Object, jmeth_jary2view(mrb, mobj, rmeth, (jarray)jv))
+
+#undef JMETH_VOID_CALLER
+#undef JMETH_CALLERS
+#undef JMETH_CALLER
+#undef JMETH_INVOKE_nonvirtual
+#undef JMETH_INVOKE_static
+#undef JMETH_INVOKE_instance
+#undef JMETH_INVOKE
+
+#define JMETH_CALLER_ENTRY(c, name) \
+  { c, { jmeth_i__call_##name, jmeth_i__call_##name##_static, jmeth_i__call_##name##_nonvirtual } }
+
+static const struct {
+  char type;
+  caller_t callers[JCALL_KINDS];
+} jmeth_callers[] = {
+  JMETH_CALLER_ENTRY('V', void),
+  JMETH_CALLER_ENTRY('Z', bool),
+  JMETH_CALLER_ENTRY('B', byte),
+  JMETH_CALLER_ENTRY('C', char),
+  JMETH_CALLER_ENTRY('S', short),
+  JMETH_CALLER_ENTRY('I', int),
+  JMETH_CALLER_ENTRY('J', long),
+  JMETH_CALLER_ENTRY('F', float),
+  JMETH_CALLER_ENTRY('D', double),
+  JMETH_CALLER_ENTRY('s', str),
+  JMETH_CALLER_ENTRY('c', class),
+  JMETH_CALLER_ENTRY('L', obj),
+};
+
+static const caller_t jmeth_ary_callers[2][JCALL_KINDS] = {
+  { jmeth_i__call_ary, jmeth_i__call_ary_static, jmeth_i__call_ary_nonvirtual },
+  { jmeth_i__call_ary_view, jmeth_i__call_ary_view_static, jmeth_i__call_ary_view_nonvirtual },
+};
+
+#undef JMETH_CALLER_ENTRY
+
+static caller_t type2caller(char ctype, enum jcall_kind kind, int depth, int view) {
+  size_t i;
+
+  if (depth) {
+    if (!jary_supported(ctype) || (view && depth != 1)) {
+      return NULL;
+    }
+    return jmeth_ary_callers[view ? 1 : 0][kind];
+  }
+  for (i = 0; i < sizeof(jmeth_callers) / sizeof(jmeth_callers[0]); i++) {
+    if (jmeth_callers[i].type == ctype) {
+      return jmeth_callers[i].callers[kind];
+    }
+  }
+  return NULL;
+}
+
+static const char *jarg_compile(const char *types, struct RJArg *arg) {
+  arg->op = JARG_NONE;
+  arg->cname = NULL;
+  arg->clen = 0;
+  arg->resolved = 0;
+  arg->klass = NULL;
+  arg->jclazz = NULL;
+  arg->elem = NULL;
+
+  switch (*types++) {
+    case 'Z': {
+      arg->op = JARG_BOOL;
+    } break;
+    case 'B': {
+      arg->op = JARG_BYTE;
+    } break;
+    case 'C': {
+      arg->op = JARG_CHAR;
+    } break;
+    case 'S': {
+      arg->op = JARG_SHORT;
+    } break;
     case 'I': {
-      return jmeth_i__call_int;
+      arg->op = JARG_INT;
+    } break;
+    case 'J': {
+      arg->op = JARG_LONG;
+    } break;
+    case 'F': {
+      arg->op = JARG_FLOAT;
+    } break;
+    case 'D': {
+      arg->op = JARG_DOUBLE;
+    } break;
+    case 's': {
+      arg->op = JARG_STR;
+    } break;
+    case 'L': {
+      const char *tail = strchr(types, ';');
+
+      if (!tail) {
+        return NULL;
+      }
+      arg->op = JARG_OBJ;
+      arg->cname = types;
+      arg->clen = tail - types;
+      types = tail + 1;
+    } break;
+    case '[': {
+      arg->op = JARG_ARY;
+      arg->elem = (struct RJArg *)malloc(sizeof(struct RJArg));
+      types = jarg_compile(types, arg->elem);
+    } break;
+    case '\0': {
+      return NULL;
+    } break;
+  }
+  return types;
+}
+
+static int jarg_compile_all(const char *types, struct RJArg *args, int argc) {
+  int i;
+
+  for (i = 0; i < argc; i++) {
+    types = jarg_compile(types, args + i);
+    if (!types) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void jmeth_init_fields(struct RJMethod *smeth) {
+  smeth->argc = 0;
+  smeth->needs_receiver = 0;
+  smeth->is_static = 0;
+  smeth->nonvirtual = 0;
+  smeth->array_view = 0;
+  smeth->rtype = 0;
+  smeth->args = NULL;
+  smeth->types = NULL;
+#if MRUBY_JNI_STATS
+  memset(&smeth->stats, 0, sizeof(smeth->stats));
+  smeth->stats.prev = smeth->stats.next = &smeth->stats;
+#endif
+}
+
+#if MRUBY_JNI_STATS
+static void jstats_register(mrb_state *mrb, struct RJMethod *smeth, mrb_value mclass,
+                            int is_static, mrb_value mname, mrb_value msig) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  struct jmeth_stats *stats = &smeth->stats;
+  mrb_value mpath;
+  const char *cpath;
+  size_t len;
+
+  mpath = mrb_iv_get(mrb, mclass, mrb_intern_cstr(mrb, "jclass_path"));
+  if (mrb_type(mpath) == MRB_TT_STRING) {
+    cpath = mrb_string_value_cstr(mrb, &mpath);
+  } else {
+    cpath = mrb_class_name(mrb, mrb_class_ptr(mclass));
+  }
+  if (!cpath) {
+    cpath = "?";
+  }
+  len = strlen(cpath) + RSTRING_LEN(mname) + RSTRING_LEN(msig) + 2;
+  free(stats->label);
+  stats->label = (char *)malloc(len);
+  if (stats->label) {
+    snprintf(stats->label, len, "%s%c%s%s", cpath, is_static ? '.' : '#',
+             RSTRING_PTR(mname), RSTRING_PTR(msig));
+  }
+  stats->prev->next = stats->next;
+  stats->next->prev = stats->prev;
+  stats->next = ctx->stats_list.next;
+  stats->prev = &ctx->stats_list;
+  stats->next->prev = stats;
+  ctx->stats_list.next = stats;
+}
+#endif
+
+/* resolve and compile a method; returns its JNI signature */
+static mrb_value jmeth_setup(mrb_state *mrb, mrb_value self, struct RJMethod *smeth,
+                             mrb_value miclass, mrb_value mret, mrb_value mname, mrb_value margs) {
+  JNIEnv* env = jni_env(mrb);
+  mrb_value mclass, msig, mjsig, mkey, mdefclass;
+  struct jmanifest_method *entry;
+  jclass jclazz;
+  jmethodID jmeth;
+  char *cname, *csig;
+  int is_static = 0;
+  struct RArray *ary;
+
+  if (mrb_type(miclass) == MRB_TT_SCLASS) {
+    is_static = 1;
+    miclass = mrb_iv_get(mrb, miclass, mrb_intern_cstr(mrb, "__attached__"));
+  }
+  smeth->is_static = is_static;
+  mclass = mrb_iv_get(mrb, miclass, mrb_intern_cstr(mrb, "jclass"));
+  jclazz = DATA_PTR(mclass);
+  smeth->jclazz = jclazz;
+  cname = mrb_string_value_cstr(mrb, &mname);
+  mdefclass = miclass;
+  mkey = jmanifest_key(mrb, miclass, is_static, mname, mret, margs);
+  entry = jmanifest_method(mrb, mkey, jclazz);
+
+  if (entry) {
+    size_t len = strlen(entry->types);
+
+    smeth->types = (char*)malloc(len + 1);
+    memcpy(smeth->types, entry->types, len + 1);
+    mjsig = mrb_str_new_cstr(mrb, entry->sig);
+    jmeth = entry->id;
+  } else {
+    msig = mrb_funcall(mrb, miclass, "get_type", 1, margs);
+    csig = mrb_string_value_cstr(mrb, &msig);
+    smeth->types = (char*)malloc(RSTRING_LEN(msig) + 1);
+    memcpy(smeth->types, csig, RSTRING_LEN(msig) + 1);
+
+    mjsig = msig = mrb_funcall(mrb, self, "get_sig", 2, mret, margs);
+    csig = mrb_string_value_cstr(mrb, &msig);
+    if (is_static) {
+      jmeth = (*env)->GetStaticMethodID(env, jclazz, cname, csig);
+    } else {
+      jmeth = (*env)->GetMethodID(env, jclazz, cname, csig);
+    }
+    if ((*env)->ExceptionCheck(env)) {
+      mrb_raisef(mrb, E_NAME_ERROR, "Jni: can't get %S%S", mname, msig);
+    }
+  }
+
+  ary = mrb_ary_ptr(margs);
+  smeth->id = jmeth;
+  if (cname[0] == '<') { /* <init> */
+    smeth->caller = jmeth_i__call_constructor;
+  } else {
+    struct RClass *rmod = mrb_module_get(mrb, "Jni");
+    int depth = 0;
+
+    rmod = mrb_class_ptr(mrb_const_get(mrb, mrb_obj_value(rmod), mrb_intern_cstr(mrb, "Generics")));
+    while (mrb_type(mret) == MRB_TT_ARRAY && RARRAY_LEN(mret)) {
+      depth++;
+      mret = *RARRAY_PTR(mret);
+    }
+    smeth->opt1.klass = mrb_class_ptr(mret);
+    if (rmod == smeth->opt1.klass) { /* Generics */
+      miclass = mrb_iv_get(mrb, miclass, mrb_intern_cstr(mrb, "@iclass"));
+      smeth->opt1.klass = mrb_class_ptr(miclass);
+    }
+
+    if (entry && entry->rtype) {
+      msig = mrb_str_new(mrb, &entry->rtype, 1);
+    } else {
+      msig = mrb_funcall(mrb, miclass, "class2type", 1, mret);
+    }
+    csig = mrb_string_value_cstr(mrb, &msig);
+    smeth->caller = type2caller(csig[0], is_static ? JCALL_STATIC : JCALL_INSTANCE, depth, 0);
+    smeth->opt2.depth = depth;
+    smeth->needs_receiver = !is_static;
+    smeth->rtype = csig[0];
+    if (!smeth->caller) {
+      mrb_value mstatic = mrb_str_new_cstr(mrb, is_static ? "static " : "");
+      mrb_value misary = mrb_str_new_cstr(mrb, depth ? "array " : "");
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: unsupported return type: %S%S%S", mstatic, misary, msig);
+    }
+  }
+  smeth->args = (struct RJArg *)calloc(ary->len, sizeof(struct RJArg));
+  smeth->argc = ary->len;
+  if (!jarg_compile_all(smeth->types, smeth->args, smeth->argc)) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: broken type string: %S", mrb_str_new_cstr(mrb, smeth->types));
+  }
+  jmanifest_log_method(mrb, mkey, mdefclass, is_static, mname, mjsig, smeth->types, smeth->rtype);
+#if MRUBY_JNI_STATS
+  jstats_register(mrb, smeth, mdefclass, is_static, mname, mjsig);
+#endif
+  return mjsig;
+}
+
+static mrb_value jmeth__initialize(mrb_state *mrb, mrb_value self) {
+  mrb_value miclass, mname, mret, margs;
+  struct RJMethod *smeth = (struct RJMethod *)malloc(sizeof(struct RJMethod));
+
+  jmeth_init_fields(smeth);
+  DATA_TYPE(self) = &jmeth_data_type;
+  DATA_PTR(self) = smeth;
+
+  mrb_get_args(mrb, "oooo", &miclass, &mret, &mname, &margs);
+  jmeth_setup(mrb, self, smeth, miclass, mret, mname, margs);
+  return self;
+}
+
+static mrb_value jmeth__types(mrb_state *mrb, mrb_value self) {
+  struct RJMethod *smeth = DATA_PTR(self);
+
+  return mrb_str_new_cstr(mrb, smeth->types);
+}
+
+static void jmeth_repick(mrb_state *mrb, struct RJMethod *smeth) {
+  enum jcall_kind kind = JCALL_INSTANCE;
+  caller_t caller;
+
+  if (smeth->is_static) {
+    kind = JCALL_STATIC;
+  } else if (smeth->nonvirtual) {
+    kind = JCALL_NONVIRTUAL;
+  }
+  caller = type2caller(smeth->rtype, kind, smeth->opt2.depth, smeth->array_view);
+  if (!caller) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: no caller for this return type");
+  }
+  smeth->caller = caller;
+}
+
+static mrb_value jmeth__set_array_view(mrb_state *mrb, mrb_value self) {
+  struct RJMethod *smeth = DATA_PTR(self);
+  mrb_value mflag;
+
+  mrb_get_args(mrb, "o", &mflag);
+  if (smeth->opt2.depth != 1 || !jary_supported(smeth->rtype)) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: array view needs a one-dimensional array return type");
+  }
+  smeth->array_view = mrb_test(mflag);
+  jmeth_repick(mrb, smeth);
+  return mflag;
+}
+
+static mrb_value jmeth__set_nonvirtual(mrb_state *mrb, mrb_value self) {
+  struct RJMethod *smeth = DATA_PTR(self);
+  mrb_value mflag;
+
+  mrb_get_args(mrb, "o", &mflag);
+  if (smeth->is_static || !smeth->rtype) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: nonvirtual call needs an instance method");
+  }
+  smeth->nonvirtual = mrb_test(mflag);
+  jmeth_repick(mrb, smeth);
+  return mflag;
+}
+
+/* bind an object parameter to its mruby class, or to IsInstanceOf when unbound */
+static void jarg_resolve(mrb_state *mrb, struct RJArg *arg, mrb_value mobj) {
+  JNIEnv* env = jni_env(mrb);
+  mrb_value mclass;
+  jclass jclazz;
+  char *cpath;
+  int i;
+
+  mclass = mrb_str_new(mrb, arg->cname, arg->clen);
+  mclass = mrb_funcall(mrb, mobj, "name2class", 1, mclass);
+  arg->resolved = 1;
+  if (mrb_type(mclass) == MRB_TT_CLASS) {
+    arg->klass = mrb_class_ptr(mclass);
+    return;
+  }
+
+  cpath = (char*)malloc(arg->clen + 1);
+  for (i = 0; i < arg->clen; i++) {
+    cpath[i] = arg->cname[i] == '.' ? '/' : arg->cname[i];
+  }
+  cpath[arg->clen] = '\0';
+  jclazz = (*env)->FindClass(env, cpath);
+  free(cpath);
+  if ((*env)->ExceptionCheck(env)) {
+    (*env)->ExceptionClear(env);
+    return;
+  }
+  arg->jclazz = (*env)->NewGlobalRef(env, jclazz);
+  (*env)->DeleteLocalRef(env, jclazz);
+}
+
+static int mobj2jvalue(mrb_state *mrb, struct RJArg *arg, mrb_value mobj, jvalue *jval);
+
+/* JVM name of the element class of a reference array, for FindClass */
+static int jarg_elem_name(struct RJArg *arg, char *buf, int size, int descriptor) {
+  const char *prim = NULL;
+  int len = 0, i;
+
+  switch (arg->op) {
+    case JARG_BOOL: prim = "Z"; break;
+    case JARG_BYTE: prim = "B"; break;
+    case JARG_CHAR: prim = "C"; break;
+    case JARG_SHORT: prim = "S"; break;
+    case JARG_INT: prim = "I"; break;
+    case JARG_LONG: prim = "J"; break;
+    case JARG_FLOAT: prim = "F"; break;
+    case JARG_DOUBLE: prim = "D"; break;
+    case JARG_STR: {
+      prim = descriptor ? "Ljava/lang/String;" : "java/lang/String";
+    } break;
+    case JARG_OBJ: {
+      if (arg->clen + 3 > size) {
+        return -1;
+      }
+      if (descriptor) {
+        buf[len++] = 'L';
+      }
+      for (i = 0; i < arg->clen; i++) {
+        buf[len++] = arg->cname[i] == '.' ? '/' : arg->cname[i];
+      }
+      if (descriptor) {
+        buf[len++] = ';';
+      }
+      buf[len] = '\0';
+      return len;
+    } break;
+    case JARG_ARY: {
+      if (size < 2) {
+        return -1;
+      }
+      buf[0] = '[';
+      len = jarg_elem_name(arg->elem, buf + 1, size - 1, 1);
+      return len < 0 ? -1 : len + 1;
+    } break;
+    default: {
+      return -1;
+    }
+  }
+  len = strlen(prim);
+  if (len + 1 > size) {
+    return -1;
+  }
+  memcpy(buf, prim, len + 1);
+  return len;
+}
+
+#define JARY_FILL(type, name, field) do { \
+  type *ptr = (type *)buf; \
+  for (i = 0; i < len; i++) { \
+    jvalue jv; \
+    mobj2jvalue(mrb, elem, ary->ptr[i], &jv); \
+    ptr[i] = jv.field; \
+  } \
+  jary = (*env)->New##name##Array(env, len); \
+  if (jary) { \
+    (*env)->Set##name##ArrayRegion(env, jary, 0, len, ptr); \
+  } \
+  JSTATS_ADD(mrb, transitions, 2); \
+} while (0)
+
+/* build a Java array from an mruby Array already checked against arg->elem */
+static jarray mary2jary(mrb_state *mrb, struct RJArg *arg, mrb_value mary) {
+  JNIEnv* env = jni_env(mrb);
+  struct RJArg *elem = arg->elem;
+  struct RArray *ary = mrb_ary_ptr(mary);
+  jarray jary = NULL;
+  jsize i, len = ary->len;
+  void *buf;
+
+  switch (elem->op) {
+    case JARG_STR:
+    case JARG_OBJ:
+    case JARG_ARY: {
+      if (!arg->jclazz) {
+        char cname[256];
+        jclass jclazz;
+
+        if (jarg_elem_name(elem, cname, sizeof(cname), 0) < 0) {
+          return NULL;
+        }
+        jclazz = (*env)->FindClass(env, cname);
+        if ((*env)->ExceptionCheck(env)) {
+          (*env)->ExceptionClear(env);
+          return NULL;
+        }
+        arg->jclazz = (*env)->NewGlobalRef(env, jclazz);
+        (*env)->DeleteLocalRef(env, jclazz);
+      }
+      jary = (*env)->NewObjectArray(env, len, arg->jclazz, NULL);
+      for (i = 0; jary && i < len; i++) {
+        mrb_value mitem = ary->ptr[i];
+        jvalue jv;
+
+        if (!mobj2jvalue(mrb, elem, mitem, &jv)) {
+          (*env)->DeleteLocalRef(env, jary);
+          return NULL;
+        }
+        (*env)->SetObjectArrayElement(env, jary, i, jv.l);
+        if (mrb_type(mitem) == MRB_TT_STRING || mrb_type(mitem) == MRB_TT_ARRAY) {
+          (*env)->DeleteLocalRef(env, jv.l);
+          JSTATS_ADD(mrb, transitions, 1);
+        }
+      }
+      JSTATS_ADD(mrb, transitions, 1 + i);
+      return jary;
+    } break;
+    default: {
+    } break;
+  }
+
+  buf = malloc(len ? len * sizeof(jvalue) : 1);
+  if (!buf) {
+    return NULL;
+  }
+  switch (elem->op) {
+    case JARG_BOOL: JARY_FILL(jboolean, Boolean, z); break;
+    case JARG_BYTE: JARY_FILL(jbyte, Byte, b); break;
+    case JARG_CHAR: JARY_FILL(jchar, Char, c); break;
+    case JARG_SHORT: JARY_FILL(jshort, Short, s); break;
+    case JARG_INT: JARY_FILL(jint, Int, i); break;
+    case JARG_LONG: JARY_FILL(jlong, Long, j); break;
+    case JARG_FLOAT: JARY_FILL(jfloat, Float, f); break;
+    case JARG_DOUBLE: JARY_FILL(jdouble, Double, d); break;
+    default: break;
+  }
+  free(buf);
+  return jary;
+}
+
+#undef JARY_FILL
+
+#define TYPE_VAL(op, mtype) ((int)(op) | ((mtype) << 8))
+
+static int mobj2jvalue(mrb_state *mrb, struct RJArg *arg, mrb_value mobj, jvalue *jval) {
+  JNIEnv* env = jni_env(mrb);
+
+  switch (TYPE_VAL(arg->op, mrb_type(mobj))) {
+    case TYPE_VAL(JARG_BOOL, MRB_TT_FALSE):
+    case TYPE_VAL(JARG_BOOL, MRB_TT_TRUE): {
+      if (jval) {
+        jval->z = mrb_bool(mobj);
+      }
+    } break;
+    case TYPE_VAL(JARG_BYTE, MRB_TT_FIXNUM): {
+      if (jval) {
+        jval->b = (jbyte)mrb_fixnum(mobj);
+      }
+    } break;
+    case TYPE_VAL(JARG_CHAR, MRB_TT_FIXNUM): {
+      if (jval) {
+        jval->c = (jchar)mrb_fixnum(mobj);
+      }
+    } break;
+    case TYPE_VAL(JARG_SHORT, MRB_TT_FIXNUM): {
+      if (jval) {
+        jval->s = (jshort)mrb_fixnum(mobj);
+      }
+    } break;
+    case TYPE_VAL(JARG_INT, MRB_TT_FIXNUM): {
+      if (jval) {
+        jval->i = mrb_fixnum(mobj);
+      }
+    } break;
+    case TYPE_VAL(JARG_LONG, MRB_TT_FIXNUM):
+    case TYPE_VAL(JARG_LONG, MRB_TT_DATA): {
+      jlong jl;
+
+      if (!mlong2jlong(mrb, mobj, &jl)) {
+        return 0;
+      }
+      if (jval) {
+        jval->j = jl;
+      }
+    } break;
+    case TYPE_VAL(JARG_FLOAT, MRB_TT_FLOAT): {
+      if (jval) {
+        jval->f = mrb_float(mobj);
+      }
+    } break;
+    case TYPE_VAL(JARG_FLOAT, MRB_TT_FIXNUM): {
+      if (jval) {
+        jval->f = mrb_fixnum(mobj);
+      }
+    } break;
+    case TYPE_VAL(JARG_DOUBLE, MRB_TT_FLOAT): {
+      if (jval) {
+        jval->d = mrb_float(mobj);
+      }
+    } break;
+    case TYPE_VAL(JARG_DOUBLE, MRB_TT_FIXNUM): {
+      if (jval) {
+        jval->d = mrb_fixnum(mobj);
+      }
+    } break;
+    case TYPE_VAL(JARG_OBJ, MRB_TT_STRING):
+    case TYPE_VAL(JARG_STR, MRB_TT_STRING): {
+      if (jval) {
+        struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+
+        if (ctx->jstr_cache && RSTRING_LEN(mobj) <= JSTR_CACHE_MAX_LEN) {
+          jval->l = (jobject)jstr_cache_get(mrb, mobj);
+        } else {
+          jval->l = (jobject)mstr2jstr(mrb, mobj);
+        }
+      }
+    } break;
+    case TYPE_VAL(JARG_OBJ, MRB_TT_FALSE):
+    case TYPE_VAL(JARG_STR, MRB_TT_FALSE): {
+      if (jval) {
+        jval->l = (jobject)NULL;
+      }
+    } break;
+    case TYPE_VAL(JARG_OBJ, MRB_TT_DATA): {
+      jobj_check_attached(mrb, mobj);
+      if (!arg->resolved) {
+        jarg_resolve(mrb, arg, mobj);
+      }
+      if (arg->klass) {
+        if (mrb_obj_class(mrb, mobj) != arg->klass && !mrb_obj_is_kind_of(mrb, mobj, arg->klass)) {
+          return 0;
+        }
+      } else if (!arg->jclazz || !jobj_data_p(mobj) || !DATA_PTR(mobj) ||
+                 !(*env)->IsInstanceOf(env, (jobject)DATA_PTR(mobj), arg->jclazz)) {
+        return 0;
+      }
+      if (jval) {
+        jval->l = (jobject)DATA_PTR(mobj);
+      }
+    } break;
+    case TYPE_VAL(JARG_ARY, MRB_TT_STRING): {
+      jsize len;
+
+      if (arg->elem->op != JARG_BYTE) {
+        return 0;
+      }
+      if (jval) {
+        len = RSTRING_LEN(mobj);
+        jval->l = (*env)->NewByteArray(env, len);
+        if (!jval->l) {
+          return 0;
+        }
+        (*env)->SetByteArrayRegion(env, jval->l, 0, len, (const jbyte *)RSTRING_PTR(mobj));
+        JSTATS_ADD(mrb, transitions, 2);
+      }
+    } break;
+    case TYPE_VAL(JARG_ARY, MRB_TT_ARRAY): {
+      struct RArray *ary = mrb_ary_ptr(mobj);
+      int i;
+
+      for (i = 0; i < ary->len; i++) {
+        if (!mobj2jvalue(mrb, arg->elem, ary->ptr[i], NULL)) {
+          return 0;
+        }
+      }
+      if (jval) {
+        jval->l = mary2jary(mrb, arg, mobj);
+        if (!jval->l) {
+          return 0;
+        }
+      }
+    } break;
+    default: {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Java exceptions as Jni::JavaException (or Jni.map_exception), message built lazily */
+struct jexc_map {
+  jclass jclazz; /* global ref */
+  struct RClass *klass;
+};
+
+static void jexc_resolve_ids(mrb_state *mrb) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  jclass jclazz;
+
+  if (ctx->throwable_to_string) {
+    return;
+  }
+  jclazz = (*env)->FindClass(env, "java/lang/Throwable");
+  ctx->throwable_to_string = (*env)->GetMethodID(env, jclazz, "toString", "()Ljava/lang/String;");
+  ctx->throwable_get_stack_trace = (*env)->GetMethodID(env, jclazz, "getStackTrace", "()[Ljava/lang/StackTraceElement;");
+  (*env)->DeleteLocalRef(env, jclazz);
+  jclazz = (*env)->FindClass(env, "java/lang/StackTraceElement");
+  ctx->frame_to_string = (*env)->GetMethodID(env, jclazz, "toString", "()Ljava/lang/String;");
+  (*env)->DeleteLocalRef(env, jclazz);
+}
+
+/* clears the pending Java exception and returns the mruby exception for it */
+static mrb_value jexc_take(mrb_state *mrb, mrb_value mname) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  struct RClass *klass = ctx->java_exception_class;
+  jthrowable jexc;
+  mrb_value mexc;
+  int i;
+
+  jexc = (*env)->ExceptionOccurred(env);
+  (*env)->ExceptionClear(env);
+  for (i = 0; i < ctx->exc_map_len; i++) {
+    if ((*env)->IsInstanceOf(env, jexc, ctx->exc_map[i].jclazz)) {
+      klass = ctx->exc_map[i].klass;
+      break;
+    }
+  }
+  mexc = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_EXCEPTION, klass));
+  mrb_iv_set(mrb, mexc, mrb_intern_cstr(mrb, "throwable"), jobj_wrap_global(mrb, ctx->object_class, jexc));
+  mrb_iv_set(mrb, mexc, mrb_intern_cstr(mrb, "java_method"), mname);
+  return mexc;
+}
+
+static jobject jexc_throwable(mrb_state *mrb, mrb_value mexc) {
+  mrb_value mthrowable = mrb_iv_get(mrb, mexc, mrb_intern_cstr(mrb, "throwable"));
+
+  if (!jobj_data_p(mthrowable)) {
+    return NULL;
+  }
+  return (jobject)DATA_PTR(mthrowable);
+}
+
+static mrb_value jexc__throwable(mrb_state *mrb, mrb_value self) {
+  return mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "throwable"));
+}
+
+static mrb_value jexc__message(mrb_state *mrb, mrb_value self) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_sym mesg = mrb_intern_cstr(mrb, "mesg");
+  mrb_value mmsg = mrb_iv_get(mrb, self, mesg);
+  mrb_value mname, mdesc = mrb_str_new(mrb, "", 0);
+  jobject jexc;
+  jstring jstr;
+
+  if (!mrb_nil_p(mmsg)) {
+    return mmsg;
+  }
+  jexc = jexc_throwable(mrb, self);
+  if (jexc) {
+    jexc_resolve_ids(mrb);
+    jstr = (jstring)(*env)->CallObjectMethod(env, jexc, ctx->throwable_to_string);
+    if ((*env)->ExceptionCheck(env)) {
+      (*env)->ExceptionClear(env);
+    } else if (jstr) {
+      mdesc = jstr2mstr(mrb, jstr);
+    }
+  }
+  mname = mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "java_method"));
+  mmsg = mrb_str_new_cstr(mrb, "exception in java method '");
+  mrb_str_concat(mrb, mmsg, mrb_obj_as_string(mrb, mname));
+  mrb_str_cat(mrb, mmsg, "': ", 3);
+  mrb_str_concat(mrb, mmsg, mdesc);
+  mrb_iv_set(mrb, self, mesg, mmsg);
+  return mmsg;
+}
+
+static mrb_value jexc__java_backtrace(mrb_state *mrb, mrb_value self) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_sym cache = mrb_intern_cstr(mrb, "java_backtrace");
+  mrb_value mback = mrb_iv_get(mrb, self, cache);
+  jobject jexc = jexc_throwable(mrb, self);
+  jobjectArray jframes;
+  jsize len, i;
+
+  if (!mrb_nil_p(mback) || !jexc) {
+    return mback;
+  }
+  jexc_resolve_ids(mrb);
+  jframes = (jobjectArray)(*env)->CallObjectMethod(env, jexc, ctx->throwable_get_stack_trace);
+  if ((*env)->ExceptionCheck(env) || !jframes) {
+    (*env)->ExceptionClear(env);
+    return mrb_nil_value();
+  }
+  len = (*env)->GetArrayLength(env, jframes);
+  mback = mrb_ary_new_capa(mrb, len);
+  for (i = 0; i < len; i++) {
+    int ai = mrb_gc_arena_save(mrb);
+    jobject jframe = (*env)->GetObjectArrayElement(env, jframes, i);
+    jstring jstr = (jstring)(*env)->CallObjectMethod(env, jframe, ctx->frame_to_string);
+
+    (*env)->DeleteLocalRef(env, jframe);
+    mrb_ary_push(mrb, mback, jstr ? jstr2mstr(mrb, jstr) : mrb_nil_value());
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  (*env)->DeleteLocalRef(env, jframes);
+  mrb_iv_set(mrb, self, cache, mback);
+  return mback;
+}
+
+/* throw mrb->exc into Java and clear it */
+static void jexc_throw_mexc(mrb_state *mrb) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mexc = mrb_obj_value(mrb->exc);
+  mrb_value mstr, mback;
+  jobject jexc;
+
+  mrb->exc = 0;
+  if (mrb_obj_is_kind_of(mrb, mexc, ctx->java_exception_class) && (jexc = jexc_throwable(mrb, mexc))) {
+    (*env)->Throw(env, (jthrowable)jexc);
+    return;
+  }
+  mstr = mrb_funcall(mrb, mexc, "message", 0);
+  if (ctx->exc_backtrace) {
+    mstr = mrb_str_dup(mrb, mstr);
+    mrb_str_cat(mrb, mstr, "\n", 1);
+    mback = mrb_funcall(mrb, mexc, "backtrace", 0);
+    mback = mrb_funcall(mrb, mback, "join", 1, mrb_str_new(mrb, "\n", 1));
+    mrb_str_concat(mrb, mstr, mback);
+  }
+  if (!ctx->runtime_exception) {
+    jclass jclazz = (*env)->FindClass(env, "java/lang/RuntimeException");
+
+    ctx->runtime_exception = (jclass)(*env)->NewGlobalRef(env, jclazz);
+    (*env)->DeleteLocalRef(env, jclazz);
+  }
+  (*env)->ThrowNew(env, ctx->runtime_exception, mrb_string_value_cstr(mrb, &mstr));
+}
+
+/* Jni.map_exception("java.lang.IllegalArgumentException", SomeError) */
+static mrb_value jni_s__map_exception(mrb_state *mrb, mrb_value self) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mjclass, mklass;
+  struct jexc_map *map;
+  struct RClass *klass;
+  jclass jclazz;
+  char *cpath, *p;
+
+  mrb_get_args(mrb, "So", &mjclass, &mklass);
+  klass = mrb_type(mklass) == MRB_TT_CLASS ? mrb_class_ptr(mklass) : NULL;
+  while (klass && klass != ctx->java_exception_class) {
+    klass = klass->super;
+  }
+  if (!klass) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "Jni: %S is not a Jni::JavaException", mklass);
+  }
+  klass = mrb_class_ptr(mklass);
+  mjclass = mrb_str_dup(mrb, mjclass);
+  cpath = mrb_string_value_cstr(mrb, &mjclass);
+  for (p = cpath; *p; p++) {
+    if (*p == '.') {
+      *p = '/';
+    }
+  }
+  jclazz = (*env)->FindClass(env, cpath);
+  if ((*env)->ExceptionCheck(env) || !jclazz) {
+    (*env)->ExceptionClear(env);
+    mrb_raisef(mrb, E_NAME_ERROR, "Jni: can't find class %S", mjclass);
+  }
+  map = (struct jexc_map *)realloc(ctx->exc_map, (ctx->exc_map_len + 1) * sizeof(struct jexc_map));
+  if (!map) {
+    (*env)->DeleteLocalRef(env, jclazz);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: can't grow exception map");
+  }
+  ctx->exc_map = map;
+  map[ctx->exc_map_len].jclazz = (jclass)(*env)->NewGlobalRef(env, jclazz);
+  map[ctx->exc_map_len].klass = klass;
+  ctx->exc_map_len++;
+  (*env)->DeleteLocalRef(env, jclazz);
+  return mklass;
+}
+
+static mrb_value jni_s__exception_backtrace(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+
+  return mrb_bool_value(ctx->exc_backtrace);
+}
+
+static mrb_value jni_s__set_exception_backtrace(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mflag;
+
+  mrb_get_args(mrb, "o", &mflag);
+  ctx->exc_backtrace = mrb_test(mflag);
+  return mflag;
+}
+
+static void jexc_clear(mrb_state *mrb) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  int i;
+
+  for (i = 0; i < ctx->exc_map_len; i++) {
+    (*env)->DeleteGlobalRef(env, ctx->exc_map[i].jclazz);
+  }
+  free(ctx->exc_map);
+  if (ctx->runtime_exception) {
+    (*env)->DeleteGlobalRef(env, ctx->runtime_exception);
+  }
+}
+
+#if MRUBY_JNI_STATS
+static inline void jstats_miss(mrb_state *mrb, struct RJMethod *smeth) {
+  if (((struct mrb_jni_context *)mrb->ud)->stats_on) {
+    smeth->stats.check_misses++;
+  }
+}
+#else
+#define jstats_miss(mrb, smeth) ((void)0)
+#endif
+
+static int jmeth_check(mrb_state *mrb, struct RJMethod *smeth, mrb_value margs) {
+  struct RArray *ary;
+  int i;
+
+  ary = mrb_ary_ptr(margs);
+  if (ary->len != smeth->argc) {
+    jstats_miss(mrb, smeth);
+    return 0;
+  }
+  for (i = 0; i < ary->len; i++) {
+    mrb_value item = ary->ptr[i];
+
+    if (!mobj2jvalue(mrb, smeth->args + i, item, NULL)) {
+      jstats_miss(mrb, smeth);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static mrb_value jmeth__check(mrb_state *mrb, mrb_value self) {
+  mrb_value margs;
+  struct RJMethod *smeth = DATA_PTR(self);
+
+  mrb_get_args(mrb, "o", &margs);
+  return mrb_bool_value(jmeth_check(mrb, smeth, margs));
+}
+
+/* per-invocation argument frame, so callbacks can re-enter the same Jni::Method */
+#define JFRAME_INLINE_ARGS 16
+
+static void jframe_release(mrb_state *mrb, mrb_value margs, jvalue *argv, int argc) {
+  JNIEnv* env = jni_env(mrb);
+  int i;
+
+  for (i = 0; i < argc; i++) {
+    switch (mrb_type(RARRAY_PTR(margs)[i])) {
+      case MRB_TT_STRING:
+      case MRB_TT_ARRAY: {
+        (*env)->DeleteLocalRef(env, argv[i].l);
+        JSTATS_ADD(mrb, transitions, 1);
+      } break;
+      default:
+        break;
+    }
+  }
+}
+
+#if MRUBY_JNI_STATS
+static void jstats_dump(mrb_state *mrb);
+
+/* t[0]: marshalling starts, t[1]: Java call starts, t[2]: Java call ends */
+static inline struct jmeth_stats *jstats_enter(mrb_state *mrb, struct RJMethod *smeth, double *t) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  struct jmeth_stats *outer = ctx->stats_cur;
+
+  t[0] = 0;
+  if (ctx->stats_on) {
+    ctx->stats_cur = &smeth->stats;
+    smeth->stats.calls++;
+    t[0] = jni_now_ns();
+  }
+  return outer;
+}
+
+static inline void jstats_lap(double *t, int i) {
+  if (t[0]) {
+    t[i] = jni_now_ns();
+  }
+}
+
+static inline void jstats_leave(mrb_state *mrb, struct RJMethod *smeth, struct jmeth_stats *outer, double *t) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+
+  if (!t[0]) {
+    return;
+  }
+  if (t[1]) {
+    smeth->stats.marshal_ns += (t[1] - t[0]) + (jni_now_ns() - t[2]);
+    smeth->stats.java_ns += t[2] - t[1];
+  } else {
+    smeth->stats.marshal_ns += jni_now_ns() - t[0];
+  }
+  ctx->stats_cur = outer;
+  ctx->stats_calls++;
+  if (ctx->stats_dump_every && !ctx->stats_dumping && ctx->stats_calls % ctx->stats_dump_every == 0) {
+    jstats_dump(mrb);
+  }
+}
+#else
+#define jstats_enter(mrb, smeth, t) NULL
+#define jstats_lap(t, i) ((void)(t))
+#define jstats_leave(mrb, smeth, outer, t) ((void)(outer))
+#endif
+
+static mrb_value jmeth_call(mrb_state *mrb, struct RJMethod *smeth, mrb_value mobj, mrb_value mname, mrb_value margs) {
+  JNIEnv* env = jni_env(mrb);
+  int i;
+  struct RArray *ary;
+  jvalue frame[JFRAME_INLINE_ARGS];
+  jvalue *argv = frame;
+  struct jmeth_stats *outer;
+  double t[3] = { 0, 0, 0 };
+  struct mrb_jmpbuf *prev_jmp, c_jmp;
+  volatile int marshalled = 0;
+  mrb_value mret = mrb_nil_value();
+
+  ary = mrb_ary_ptr(margs);
+  if (ary->len != smeth->argc) {
+    jstats_miss(mrb, smeth);
+    return mrb_false_value();
+  }
+  if (smeth->needs_receiver && (!jobj_data_p(mobj) || !DATA_PTR(mobj))) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: no Java object behind receiver of '%S' (released local reference?)", mname);
+  }
+  jni_safe_point(mrb);
+  if (smeth->argc > JFRAME_INLINE_ARGS) {
+    mrb_value mbuf = mrb_str_buf_new(mrb, smeth->argc * sizeof(jvalue));
+    argv = (jvalue *)RSTRING_PTR(mbuf);
+  }
+
+  outer = jstats_enter(mrb, smeth, t);
+  /* converting an argument or the result can raise; the frame is released either way */
+  prev_jmp = mrb->jmp;
+  MRB_TRY(&c_jmp) {
+    mrb->jmp = &c_jmp;
+    for (i = 0; i < ary->len; i++) {
+      if (!mobj2jvalue(mrb, smeth->args + i, ary->ptr[i], argv + i)) {
+        break;
+      }
+      marshalled = i + 1;
+    }
+    if (marshalled == smeth->argc) {
+      jstats_lap(t, 1);
+      mret = smeth->caller(mrb, mobj, smeth, argv);
+      jstats_lap(t, 2);
+    }
+    mrb->jmp = prev_jmp;
+  } MRB_CATCH(&c_jmp) {
+    mrb->jmp = prev_jmp;
+    jframe_release(mrb, margs, argv, marshalled);
+    jstats_leave(mrb, smeth, outer, t);
+    mrb_exc_raise(mrb, mrb_obj_value(mrb->exc));
+  } MRB_END_EXC(&c_jmp);
+
+  jframe_release(mrb, margs, argv, marshalled);
+  if (marshalled != smeth->argc) {
+    jstats_miss(mrb, smeth);
+    jstats_leave(mrb, smeth, outer, t);
+    return mrb_false_value();
+  }
+  JSTATS_ADD(mrb, transitions, 2); /* the call and ExceptionCheck */
+  if ((*env)->ExceptionCheck(env)) {
+    jstats_leave(mrb, smeth, outer, t);
+    mrb_exc_raise(mrb, jexc_take(mrb, mname));
+  }
+  jstats_leave(mrb, smeth, outer, t);
+  return mret;
+}
+
+static mrb_value jmeth__call(mrb_state *mrb, mrb_value self) {
+  mrb_value mobj, mname, margs;
+
+  mrb_get_args(mrb, "ooo", &mobj, &mname, &margs);
+  return jmeth_call(mrb, DATA_PTR(self), mobj, mname, margs);
+}
+
+/* Jni::Method#call_batch(receivers, name, args_list) { |result| ... } */
+static mrb_value jmeth__call_batch(mrb_state *mrb, mrb_value self) {
+  struct RJMethod *smeth = DATA_PTR(self);
+  mrb_value mrecvs, mname, margslist, mblk, mresults, mnoargs;
+  mrb_int count, i;
+  int recv_ary, ai;
+
+  mrb_get_args(mrb, "ooo&", &mrecvs, &mname, &margslist, &mblk);
+  if (!smeth->rtype) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: constructors can't be batched");
+  }
+  recv_ary = mrb_type(mrecvs) == MRB_TT_ARRAY;
+  if (!mrb_nil_p(margslist) && mrb_type(margslist) != MRB_TT_ARRAY) {
+    mrb_raisef(mrb, E_TYPE_ERROR, "Jni: argument list must be an Array or nil");
+  }
+  if (recv_ary) {
+    count = RARRAY_LEN(mrecvs);
+    if (!mrb_nil_p(margslist) && RARRAY_LEN(margslist) != count) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "Jni: %S receivers but %S argument lists",
+                 mrb_fixnum_value(count), mrb_fixnum_value(RARRAY_LEN(margslist)));
+    }
+  } else if (mrb_nil_p(margslist)) {
+    count = 1;
+  } else {
+    count = RARRAY_LEN(margslist);
+  }
+  mnoargs = mrb_ary_new(mrb);
+
+  /* check every tuple against the plan before running any call */
+  for (i = 0; i < count; i++) {
+    mrb_value margs = mrb_nil_p(margslist) ? mnoargs : RARRAY_PTR(margslist)[i];
+
+    if (mrb_type(margs) != MRB_TT_ARRAY || !jmeth_check(mrb, smeth, margs)) {
+      mrb_raisef(mrb, E_TYPE_ERROR, "Jni: arguments #%S don't match '%S'", mrb_fixnum_value(i), mname);
+    }
+  }
+
+  mresults = mrb_nil_p(mblk) ? mrb_ary_new_capa(mrb, count) : mrb_nil_value();
+  ai = mrb_gc_arena_save(mrb);
+  for (i = 0; i < count; i++) {
+    mrb_value mrecv = recv_ary ? RARRAY_PTR(mrecvs)[i] : mrecvs;
+    mrb_value margs = mrb_nil_p(margslist) ? mnoargs : RARRAY_PTR(margslist)[i];
+    mrb_value mret = jmeth_call(mrb, smeth, mrecv, mname, margs);
+
+    if (mrb_nil_p(mblk)) {
+      mrb_ary_push(mrb, mresults, mret);
+    } else {
+      mrb_yield(mrb, mblk, mret);
+    }
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  return mrb_nil_p(mblk) ? mresults : mrecvs;
+}
+
+/* Jni::CallSite: overload resolution cached on the mruby class of each argument */
+#define CALLSITE_ENTRIES 4
+#define CALLSITE_MAX_ARGS 8
+#define CALLSITE_MEGAMORPHIC 32
+
+struct RJCallSiteEntry {
+  int argc;
+  struct RClass *klass[CALLSITE_MAX_ARGS];
+  struct RJMethod *meth;
+};
+
+struct RJCallSite {
+  int size;
+  int next;
+  int megamorphic;
+  unsigned long hits;
+  unsigned long misses;
+  struct RJCallSiteEntry entries[CALLSITE_ENTRIES];
+};
+
+static void jsite_free(mrb_state *mrb, void *p) {
+  free(p);
+}
+
+static const struct mrb_data_type jsite_data_type = {
+  "jcallsite", jsite_free,
+};
+
+static void jsite_clear(struct RJCallSite *ssite) {
+  ssite->size = 0;
+  ssite->next = 0;
+  ssite->megamorphic = 0;
+}
+
+static int jsite_key(mrb_state *mrb, mrb_value margs, struct RClass **klass) {
+  struct RArray *ary = mrb_ary_ptr(margs);
+  mrb_sym jclass_sym = 0;
+  int i;
+
+  if (ary->len > CALLSITE_MAX_ARGS) {
+    return 0;
+  }
+  for (i = 0; i < ary->len; i++) {
+    mrb_value marg = ary->ptr[i];
+
+    if (mrb_type(marg) == MRB_TT_ARRAY || mrb_nil_p(marg)) {
+      return 0;
+    }
+    klass[i] = mrb_obj_class(mrb, marg);
+    if (jobj_data_p(marg)) {
+      if (!jclass_sym) {
+        jclass_sym = mrb_intern_cstr(mrb, "jclass");
+      }
+      if (mrb_nil_p(mrb_iv_get(mrb, mrb_obj_value(klass[i]), jclass_sym))) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+static struct RJMethod *jsite_lookup(struct RJCallSite *ssite, int argc, struct RClass **klass) {
+  int i, j;
+
+  for (i = 0; i < ssite->size; i++) {
+    struct RJCallSiteEntry *entry = ssite->entries + i;
+
+    if (entry->argc != argc) {
+      continue;
+    }
+    for (j = 0; j < argc; j++) {
+      if (entry->klass[j] != klass[j]) {
+        break;
+      }
+    }
+    if (j == argc) {
+      return entry->meth;
+    }
+  }
+  return NULL;
+}
+
+static struct RJMethod *jsite_resolve(mrb_state *mrb, mrb_value self, mrb_value margs) {
+  struct RJCallSite *ssite = DATA_PTR(self);
+  struct RClass *klass[CALLSITE_MAX_ARGS];
+  struct RJMethod *smeth;
+  struct RJCallSiteEntry *entry;
+  mrb_value mmeths;
+  int i, argc, cacheable;
+
+  argc = RARRAY_LEN(margs);
+  cacheable = !ssite->megamorphic && jsite_key(mrb, margs, klass);
+  if (cacheable) {
+    smeth = jsite_lookup(ssite, argc, klass);
+    if (smeth) {
+      ssite->hits++;
+      return smeth;
+    }
+  }
+  ssite->misses++;
+
+  smeth = NULL;
+  mmeths = mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "overloads"));
+  for (i = 0; i < RARRAY_LEN(mmeths); i++) {
+    struct RJMethod *scand = DATA_PTR(RARRAY_PTR(mmeths)[i]);
+
+    if (jmeth_check(mrb, scand, margs)) {
+      smeth = scand;
+      break;
+    }
+  }
+  if (!smeth || !cacheable) {
+    return smeth;
+  }
+  if (ssite->misses > CALLSITE_MEGAMORPHIC && ssite->size == CALLSITE_ENTRIES) {
+    ssite->megamorphic = 1;
+    return smeth;
+  }
+
+  if (ssite->size < CALLSITE_ENTRIES) {
+    entry = ssite->entries + ssite->size++;
+  } else {
+    entry = ssite->entries + ssite->next;
+    ssite->next = (ssite->next + 1) % CALLSITE_ENTRIES;
+  }
+  entry->argc = argc;
+  for (i = 0; i < argc; i++) {
+    entry->klass[i] = klass[i];
+  }
+  entry->meth = smeth;
+  return smeth;
+}
+
+static mrb_value jsite__initialize(mrb_state *mrb, mrb_value self) {
+  mrb_value mmeths;
+  struct RJCallSite *ssite = (struct RJCallSite *)malloc(sizeof(struct RJCallSite));
+
+  DATA_TYPE(self) = &jsite_data_type;
+  DATA_PTR(self) = ssite;
+  jsite_clear(ssite);
+  ssite->hits = 0;
+  ssite->misses = 0;
+
+  mrb_get_args(mrb, "A", &mmeths);
+  mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, "overloads"), mrb_ary_new_from_values(mrb, RARRAY_LEN(mmeths), RARRAY_PTR(mmeths)));
+  return self;
+}
+
+static mrb_value jsite__add(mrb_state *mrb, mrb_value self) {
+  mrb_value mmeth;
+
+  mrb_get_args(mrb, "o", &mmeth);
+  if (mrb_type(mmeth) != MRB_TT_DATA || DATA_TYPE(mmeth) != &jmeth_data_type) {
+    mrb_raisef(mrb, E_TYPE_ERROR, "Jni: not a Jni::Method");
+  }
+  mrb_ary_push(mrb, mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "overloads")), mmeth);
+  jsite_clear(DATA_PTR(self));
+  return self;
+}
+
+static mrb_value jsite__overloads(mrb_state *mrb, mrb_value self) {
+  return mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "overloads"));
+}
+
+static mrb_value jsite__resolve(mrb_state *mrb, mrb_value self) {
+  mrb_value margs, mmeths;
+  struct RJMethod *smeth;
+  int i;
+
+  mrb_get_args(mrb, "A", &margs);
+  smeth = jsite_resolve(mrb, self, margs);
+  if (!smeth) {
+    return mrb_nil_value();
+  }
+  mmeths = mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "overloads"));
+  for (i = 0; i < RARRAY_LEN(mmeths); i++) {
+    if (DATA_PTR(RARRAY_PTR(mmeths)[i]) == smeth) {
+      return RARRAY_PTR(mmeths)[i];
+    }
+  }
+  return mrb_nil_value();
+}
+
+static mrb_value jsite__call(mrb_state *mrb, mrb_value self) {
+  mrb_value mobj, mname, margs;
+  struct RJMethod *smeth;
+
+  mrb_get_args(mrb, "ooA", &mobj, &mname, &margs);
+  smeth = jsite_resolve(mrb, self, margs);
+  if (!smeth) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "Jni: no overload of '%S' matches the arguments", mname);
+  }
+  return jmeth_call(mrb, smeth, mobj, mname, margs);
+}
+
+static mrb_value jsite__stats(mrb_state *mrb, mrb_value self) {
+  struct RJCallSite *ssite = DATA_PTR(self);
+  mrb_value mhash = mrb_hash_new(mrb);
+
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "hits")), mrb_fixnum_value(ssite->hits));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "misses")), mrb_fixnum_value(ssite->misses));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "entries")), mrb_fixnum_value(ssite->size));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "megamorphic")), mrb_bool_value(ssite->megamorphic));
+  return mhash;
+}
+
+/* Jni::Native: RegisterNatives onto trampoline slots, callable from the owning state's thread only */
+#define JNATIVE_SLOTS 8
+#define JNATIVE_ARITY 3
+#define JNATIVE_SHAPES 15 /* jint or reference per parameter, up to JNATIVE_ARITY */
+
+enum jnative_ret {
+  JNATIVE_R_V,
+  JNATIVE_R_Z,
+  JNATIVE_R_I,
+  JNATIVE_R_J,
+  JNATIVE_R_D,
+  JNATIVE_R_L,
+  JNATIVE_RKINDS,
+};
+
+struct RJNative;
+
+struct jnative_slot {
+  mrb_state *mrb;
+  struct RJNative *snative; /* NULL once the handler is gone */
+  jweak jclazz;
+  char *name_sig;
+  int used;
+};
+
+struct RJNative {
+  struct RJMethod meth; /* first, so Jni::Method methods work on it */
+  struct RClass *klass; /* mruby class of the declaring Java class */
+  struct jnative_slot *slot;
+  mrb_value handler; /* kept alive by the "handler" ivar */
+  mrb_sym mid;
+};
+
+static pthread_mutex_t jnative_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct jnative_slot jnative_slots[JNATIVE_RKINDS][JNATIVE_SHAPES][JNATIVE_SLOTS];
+
+static void jnative_throw(JNIEnv *env, const char *cname, const char *msg) {
+  jclass jclazz = (*env)->FindClass(env, cname);
+
+  if (jclazz) {
+    (*env)->ThrowNew(env, jclazz, msg);
+    (*env)->DeleteLocalRef(env, jclazz);
+  }
+}
+
+static mrb_value jnative_arg2mobj(mrb_state *mrb, struct RJArg *arg, jvalue *jval) {
+  switch (arg->op) {
+    case JARG_INT: {
+      return mrb_fixnum_value(jval->i);
     } break;
-    case 'I' | FLAG_STATIC: {
-      return jmeth_i__call_int_static;
+    case JARG_STR: {
+      if (jval->l) {
+        return jstr2mstr(mrb, (jstring)jval->l);
+      }
     } break;
-    case 'I' | FLAG_ARY: {
-      return jmeth_i__call_int_ary;
+    case JARG_OBJ: {
+      if (jval->l) {
+        return jobj_wrap_global(mrb, arg->klass, jval->l);
+      }
     } break;
-    case 'J': {
-      return jmeth_i__call_long;
+    default: break;
+  }
+  return mrb_nil_value();
+}
+
+/* row of the trampolines whose prototype matches the parameters */
+static int jnative_shape(struct RJMethod *smeth) {
+  int shape = (1 << smeth->argc) - 1, i;
+
+  for (i = 0; i < smeth->argc; i++) {
+    if (smeth->args[i].op != JARG_INT) {
+      shape += 1 << i;
+    }
+  }
+  return shape;
+}
+
+static int jnative_mobj2jvalue(mrb_state *mrb, struct RJMethod *smeth, mrb_value mret, jvalue *jret) {
+  JNIEnv* env = jni_env(mrb);
+
+  switch (TYPE_VAL(smeth->rtype, mrb_type(mret))) {
+    case TYPE_VAL('V', MRB_TT_FALSE):
+    case TYPE_VAL('s', MRB_TT_FALSE):
+    case TYPE_VAL('L', MRB_TT_FALSE): {
+      if (mrb_nil_p(mret) || smeth->rtype == 'V') {
+        jret->l = NULL;
+        return 1;
+      }
     } break;
-    case 'J' | FLAG_ARY: {
-      return jmeth_i__call_long_ary;
+    case TYPE_VAL('s', MRB_TT_STRING):
+    case TYPE_VAL('L', MRB_TT_STRING): {
+      jret->l = (jobject)mstr2jstr(mrb, mret);
+      return jret->l != NULL;
     } break;
-    case 'F': {
-      return jmeth_i__call_float;
+    case TYPE_VAL('L', MRB_TT_DATA): {
+      jobj_check_attached(mrb, mret);
+      if (jobj_data_p(mret)) {
+        jret->l = (*env)->NewLocalRef(env, (jobject)DATA_PTR(mret));
+        return 1;
+      }
+    } break;
+    case TYPE_VAL('I', MRB_TT_FIXNUM): {
+      jret->i = (jint)mrb_fixnum(mret);
+      return 1;
+    } break;
+    case TYPE_VAL('I', MRB_TT_FLOAT): {
+      jret->i = (jint)mrb_float(mret);
+      return 1;
+    } break;
+    case TYPE_VAL('J', MRB_TT_FIXNUM):
+    case TYPE_VAL('J', MRB_TT_DATA): {
+      return mlong2jlong(mrb, mret, &jret->j);
+    } break;
+    case TYPE_VAL('D', MRB_TT_FIXNUM): {
+      jret->d = mrb_fixnum(mret);
+      return 1;
+    } break;
+    case TYPE_VAL('D', MRB_TT_FLOAT): {
+      jret->d = mrb_float(mret);
+      return 1;
     } break;
+  }
+  if (smeth->rtype == 'V') {
+    return 1;
+  }
+  if (smeth->rtype == 'Z') {
+    jret->z = mrb_test(mret);
+    return 1;
+  }
+  return 0;
+}
+
+/* converting the mruby exception can raise again; fall back to a plain RuntimeException */
+static void jnative_throw_mexc(mrb_state *mrb, JNIEnv *env) {
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp, c_jmp;
+
+  MRB_TRY(&c_jmp) {
+    mrb->jmp = &c_jmp;
+    jexc_throw_mexc(mrb);
+    mrb->jmp = prev_jmp;
+  } MRB_CATCH(&c_jmp) {
+    mrb->jmp = prev_jmp;
+    mrb->exc = 0;
+    jnative_throw(env, "java/lang/RuntimeException", "mruby handler raised an exception");
+  } MRB_END_EXC(&c_jmp);
+}
+
+static jvalue jnative_dispatch(JNIEnv *env, jobject jself, struct jnative_slot *slot, jvalue *args) {
+  struct RJNative *snative;
+  mrb_state *mrb;
+  struct RJMethod *smeth;
+  struct mrb_jmpbuf *prev_jmp, c_jmp;
+  mrb_value argv[JNATIVE_ARITY + 1], mret;
+  jvalue jret;
+  volatile int converted = 0;
+  int ai, i;
+
+  jret.j = 0;
+  pthread_mutex_lock(&jnative_lock);
+  snative = slot->snative;
+  mrb = slot->mrb;
+  pthread_mutex_unlock(&jnative_lock);
+  if (!snative) {
+    jnative_throw(env, "java/lang/IllegalStateException", "mruby handler is no longer available");
+    return jret;
+  }
+  if (pthread_getspecific(jni_state_key) != mrb) {
+    jnative_throw(env, "java/lang/IllegalStateException", "mruby handler called from a thread that doesn't own its state");
+    return jret;
+  }
+  smeth = &snative->meth;
+  ai = mrb_gc_arena_save(mrb);
+
+  /* nothing may unwind through the Java frames above us */
+  prev_jmp = mrb->jmp;
+  MRB_TRY(&c_jmp) {
+    mrb->jmp = &c_jmp;
+    if (smeth->is_static) {
+      argv[0] = mrb_obj_value(snative->klass);
+    } else {
+      argv[0] = jobj_wrap_global(mrb, snative->klass, jself);
+    }
+    for (i = 0; i < smeth->argc; i++) {
+      argv[i + 1] = jnative_arg2mobj(mrb, smeth->args + i, args + i);
+    }
+    mret = mrb_funcall_argv(mrb, snative->handler, snative->mid, smeth->argc + 1, argv);
+    if (!mrb->exc) {
+      converted = jnative_mobj2jvalue(mrb, smeth, mret, &jret);
+    }
+    mrb->jmp = prev_jmp;
+  } MRB_CATCH(&c_jmp) {
+    mrb->jmp = prev_jmp;
+  } MRB_END_EXC(&c_jmp);
+  if (mrb->exc) {
+    jnative_throw_mexc(mrb, env);
+  } else if (!converted) {
+    jnative_throw(env, "java/lang/ClassCastException", "mruby handler returned a value of the wrong type");
+  }
+  mrb_gc_arena_restore(mrb, ai);
+  return jret;
+}
+
+#define JNATIVE_RTYPE_V void
+#define JNATIVE_RTYPE_Z jboolean
+#define JNATIVE_RTYPE_I jint
+#define JNATIVE_RTYPE_J jlong
+#define JNATIVE_RTYPE_D jdouble
+#define JNATIVE_RTYPE_L jobject
+#define JNATIVE_RETURN_V(e) (e)
+#define JNATIVE_RETURN_Z(e) return (e).z
+#define JNATIVE_RETURN_I(e) return (e).i
+#define JNATIVE_RETURN_J(e) return (e).j
+#define JNATIVE_RETURN_D(e) return (e).d
+#define JNATIVE_RETURN_L(e) return (e).l
+#define JNATIVE_P_I(k) , jint a##k
+#define JNATIVE_P_L(k) , jobject a##k
+#define JNATIVE_A_I(k) args[k].i = a##k;
+#define JNATIVE_A_L(k) args[k].l = a##k;
+#define JNATIVE_SHAPE_0(m)
+#define JNATIVE_SHAPE_1(m) m##I(0)
+#define JNATIVE_SHAPE_2(m) m##L(0)
+#define JNATIVE_SHAPE_3(m) m##I(0) m##I(1)
+#define JNATIVE_SHAPE_4(m) m##L(0) m##I(1)
+#define JNATIVE_SHAPE_5(m) m##I(0) m##L(1)
+#define JNATIVE_SHAPE_6(m) m##L(0) m##L(1)
+#define JNATIVE_SHAPE_7(m) m##I(0) m##I(1) m##I(2)
+#define JNATIVE_SHAPE_8(m) m##L(0) m##I(1) m##I(2)
+#define JNATIVE_SHAPE_9(m) m##I(0) m##L(1) m##I(2)
+#define JNATIVE_SHAPE_10(m) m##L(0) m##L(1) m##I(2)
+#define JNATIVE_SHAPE_11(m) m##I(0) m##I(1) m##L(2)
+#define JNATIVE_SHAPE_12(m) m##L(0) m##I(1) m##L(2)
+#define JNATIVE_SHAPE_13(m) m##I(0) m##L(1) m##L(2)
+#define JNATIVE_SHAPE_14(m) m##L(0) m##L(1) m##L(2)
+
+/* prototypes match the Java signature exactly: jint or jobject per parameter */
+#define JNATIVE_TRAMPOLINE(r, n, i) \
+static JNATIVE_RTYPE_##r JNICALL jnative_##r##_##n##_##i(JNIEnv *env, jobject jself JNATIVE_SHAPE_##n(JNATIVE_P_)) { \
+  jvalue args[JNATIVE_ARITY]; \
+  JNATIVE_SHAPE_##n(JNATIVE_A_) \
+  JNATIVE_RETURN_##r(jnative_dispatch(env, jself, &jnative_slots[JNATIVE_R_##r][n][i], args)); \
+}
+#define JNATIVE_FNPTR(r, n, i) (void *)jnative_##r##_##n##_##i,
+
+#define JNATIVE_EACH_SLOT(m, r, n) \
+  m(r, n, 0) m(r, n, 1) m(r, n, 2) m(r, n, 3) m(r, n, 4) m(r, n, 5) m(r, n, 6) m(r, n, 7)
+#define JNATIVE_EACH_SHAPE(m, r) \
+  m(r, 0) m(r, 1) m(r, 2) m(r, 3) m(r, 4) m(r, 5) m(r, 6) m(r, 7) \
+  m(r, 8) m(r, 9) m(r, 10) m(r, 11) m(r, 12) m(r, 13) m(r, 14)
+#define JNATIVE_TRAMPOLINES(r, n) JNATIVE_EACH_SLOT(JNATIVE_TRAMPOLINE, r, n)
+#define JNATIVE_FNPTRS(r, n) { JNATIVE_EACH_SLOT(JNATIVE_FNPTR, r, n) },
+#define JNATIVE_ROWS(r) { JNATIVE_EACH_SHAPE(JNATIVE_FNPTRS, r) },
+
+JNATIVE_EACH_SHAPE(JNATIVE_TRAMPOLINES, V)
+JNATIVE_EACH_SHAPE(JNATIVE_TRAMPOLINES, Z)
+JNATIVE_EACH_SHAPE(JNATIVE_TRAMPOLINES, I)
+JNATIVE_EACH_SHAPE(JNATIVE_TRAMPOLINES, J)
+JNATIVE_EACH_SHAPE(JNATIVE_TRAMPOLINES, D)
+JNATIVE_EACH_SHAPE(JNATIVE_TRAMPOLINES, L)
+
+static void *const jnative_fns[JNATIVE_RKINDS][JNATIVE_SHAPES][JNATIVE_SLOTS] = {
+  JNATIVE_ROWS(V)
+  JNATIVE_ROWS(Z)
+  JNATIVE_ROWS(I)
+  JNATIVE_ROWS(J)
+  JNATIVE_ROWS(D)
+  JNATIVE_ROWS(L)
+};
+
+#undef JNATIVE_ROWS
+#undef JNATIVE_FNPTRS
+#undef JNATIVE_TRAMPOLINES
+#undef JNATIVE_EACH_SHAPE
+#undef JNATIVE_EACH_SLOT
+#undef JNATIVE_FNPTR
+#undef JNATIVE_TRAMPOLINE
+
+static void jnative_free(mrb_state *mrb, void *p) {
+  struct RJNative *snative = (struct RJNative *)p;
+
+  if (snative->slot) {
+    pthread_mutex_lock(&jnative_lock);
+    snative->slot->snative = NULL;
+    pthread_mutex_unlock(&jnative_lock);
+  }
+  jmeth_free(mrb, p);
+}
+
+static const struct mrb_data_type jnative_data_type = {
+  "jnative", jnative_free,
+};
+
+static int jnative_ret_kind(struct RJMethod *smeth) {
+  if (smeth->opt2.depth) {
+    return -1;
+  }
+  switch (smeth->rtype) {
+    case 'V': return JNATIVE_R_V;
+    case 'Z': return JNATIVE_R_Z;
+    case 'I': return JNATIVE_R_I;
+    case 'J': return JNATIVE_R_J;
+    case 'D': return JNATIVE_R_D;
+    case 's':
+    case 'L': return JNATIVE_R_L;
+  }
+  return -1;
+}
+
+/* Jni::Native.new(klass_or_singleton, ret, name, args, handler = nil, method = :call, &block) */
+static mrb_value jnative__initialize(mrb_state *mrb, mrb_value self) {
+  JNIEnv* env = jni_env(mrb);
+  mrb_value miclass, mret, mname, margs, mhandler = mrb_nil_value(), mmid = mrb_nil_value(), mblk, msig, mnatives;
+  struct RJNative *snative = (struct RJNative *)malloc(sizeof(struct RJNative));
+  struct RJMethod *smeth = &snative->meth;
+  struct jnative_slot *slot = NULL;
+  JNINativeMethod jnm;
+  char *name_sig;
+  int kind, shape, taken = 0, r, n, i;
+
+  jmeth_init_fields(smeth);
+  snative->slot = NULL;
+  snative->klass = NULL;
+  snative->handler = mrb_nil_value();
+  DATA_TYPE(self) = &jnative_data_type;
+  DATA_PTR(self) = snative;
+
+  mrb_get_args(mrb, "oooo|oo&", &miclass, &mret, &mname, &margs, &mhandler, &mmid, &mblk);
+  if (mrb_nil_p(mhandler)) {
+    mhandler = mblk;
+  }
+  if (mrb_nil_p(mhandler)) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "Jni: native method needs a handler or a block");
+  }
+  snative->mid = mrb_nil_p(mmid) ? mrb_intern_cstr(mrb, "call") : mrb_symbol(mmid);
+  snative->handler = mhandler;
+  mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, "handler"), mhandler);
+
+  msig = jmeth_setup(mrb, self, smeth, miclass, mret, mname, margs);
+  if (mrb_type(miclass) == MRB_TT_SCLASS) {
+    miclass = mrb_iv_get(mrb, miclass, mrb_intern_cstr(mrb, "__attached__"));
+  }
+  snative->klass = mrb_class_ptr(miclass);
+
+  kind = jnative_ret_kind(smeth);
+  if (kind < 0 || smeth->argc > JNATIVE_ARITY) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: unsupported native signature %S%S", mname, msig);
+  }
+  for (i = 0; i < smeth->argc; i++) {
+    struct RJArg *arg = smeth->args + i;
+    mrb_value mtype = RARRAY_PTR(margs)[i];
+
+    switch (arg->op) {
+      case JARG_INT: case JARG_STR: {
+      } break;
+      case JARG_BOOL: case JARG_BYTE: case JARG_CHAR: case JARG_SHORT:
+      case JARG_LONG: case JARG_FLOAT: case JARG_DOUBLE: {
+        /* trampolines are only generated for jint and reference parameters */
+        mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: parameter #%S in native %S%S must be an int or a reference", mrb_fixnum_value(i), mname, msig);
+      } break;
+      case JARG_OBJ: {
+        arg->resolved = 1;
+        if (mrb_type(mtype) == MRB_TT_CLASS) {
+          arg->klass = mrb_class_ptr(mtype);
+        } else {
+          arg->klass = mrb_class_get_under(mrb, mrb_module_get(mrb, "Jni"), "Object");
+        }
+      } break;
+      default: {
+        mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: unsupported native parameter #%S in %S%S", mrb_fixnum_value(i), mname, msig);
+      }
+    }
+  }
+
+  shape = jnative_shape(smeth);
+  jnm.name = mrb_string_value_cstr(mrb, &mname);
+  jnm.signature = mrb_string_value_cstr(mrb, &msig);
+  name_sig = (char *)malloc(strlen(jnm.name) + strlen(jnm.signature) + 1);
+  if (!name_sig) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Jni: out of memory");
+  }
+  strcpy(name_sig, jnm.name);
+  strcat(name_sig, jnm.signature);
+
+  pthread_mutex_lock(&jnative_lock);
+  for (r = 0; r < JNATIVE_RKINDS && !taken; r++) {
+    for (n = 0; n < JNATIVE_SHAPES && !taken; n++) {
+      for (i = 0; i < JNATIVE_SLOTS; i++) {
+        struct jnative_slot *other = &jnative_slots[r][n][i];
+
+        if (other->mrb && other->mrb != mrb && other->snative && !strcmp(other->name_sig, name_sig) &&
+            (*env)->IsSameObject(env, other->jclazz, smeth->jclazz)) {
+          taken = 1;
+          break;
+        }
+      }
+    }
+  }
+  for (i = 0; i < JNATIVE_SLOTS && !taken; i++) {
+    if (!jnative_slots[kind][shape][i].used) {
+      slot = &jnative_slots[kind][shape][i];
+      slot->used = 1;
+      slot->mrb = mrb;
+      slot->snative = snative;
+      slot->jclazz = (*env)->NewWeakGlobalRef(env, smeth->jclazz);
+      slot->name_sig = name_sig;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&jnative_lock);
+  if (taken) {
+    free(name_sig);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: native %S%S is already bound by another mrb_state", mname, msig);
+  }
+  if (!slot) {
+    free(name_sig);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: no native trampoline left for %S%S", mname, msig);
+  }
+  snative->slot = slot;
+
+  jnm.fnPtr = jnative_fns[kind][shape][slot - jnative_slots[kind][shape]];
+  if ((*env)->RegisterNatives(env, smeth->jclazz, &jnm, 1) != JNI_OK || (*env)->ExceptionCheck(env)) {
+    (*env)->ExceptionClear(env);
+    /* never registered, so the trampoline can go back to the pool */
+    pthread_mutex_lock(&jnative_lock);
+    (*env)->DeleteWeakGlobalRef(env, slot->jclazz);
+    free(slot->name_sig);
+    slot->jclazz = NULL;
+    slot->name_sig = NULL;
+    slot->snative = NULL;
+    slot->mrb = NULL;
+    slot->used = 0;
+    pthread_mutex_unlock(&jnative_lock);
+    snative->slot = NULL;
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: can't register native %S%S", mname, msig);
+  }
+
+  /* the binding lives as long as the mrb_state */
+  mnatives = mrb_iv_get(mrb, mrb_obj_value(mrb_module_get(mrb, "Jni")), mrb_intern_cstr(mrb, "__natives__"));
+  if (mrb_nil_p(mnatives)) {
+    mnatives = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, mrb_obj_value(mrb_module_get(mrb, "Jni")), mrb_intern_cstr(mrb, "__natives__"), mnatives);
+  }
+  mrb_ary_push(mrb, mnatives, self);
+  return self;
+}
+
+/* called from gem_final: Java calls after this throw instead of reaching a closed state */
+static void jnative_detach_all(mrb_state *mrb) {
+  int r, n, i;
+
+  pthread_mutex_lock(&jnative_lock);
+  for (r = 0; r < JNATIVE_RKINDS; r++) {
+    for (n = 0; n < JNATIVE_SHAPES; n++) {
+      for (i = 0; i < JNATIVE_SLOTS; i++) {
+        if (jnative_slots[r][n][i].mrb == mrb) {
+          jnative_slots[r][n][i].snative = NULL;
+          jnative_slots[r][n][i].mrb = NULL;
+        }
+      }
+    }
+  }
+  pthread_mutex_unlock(&jnative_lock);
+}
+
+/* Jni::Field: a field accessor resolved once */
+struct RJField;
+
+typedef mrb_value (*jfield_get_t)(mrb_state*, mrb_value, struct RJField*);
+typedef void (*jfield_set_t)(mrb_state*, mrb_value, struct RJField*, jvalue*);
+
+struct RJField {
+  jfieldID id;
+  jclass jclazz;
+  struct RClass *klass; /* mruby class of object values */
+  jfield_get_t get;
+  jfield_set_t set; /* NULL for types that can't be assigned from mruby */
+  struct RJArg arg; /* marshalling plan for set */
+  int is_static;
+  char ftype; /* type from class2type */
+};
+
+static void jfield_free(mrb_state *mrb, void *p) {
+  free(p);
+}
+
+static const struct mrb_data_type jfield_data_type = {
+  "jfield", jfield_free,
+};
+
+static mrb_value jfield_jobj2mobj(mrb_state *mrb, mrb_value mobj, struct RJField *sfield, jobject jobj) {
+  if (!jobj) {
+    return mrb_nil_value();
+  }
+  switch (sfield->ftype) {
     case 's': {
-      return jmeth_i__call_str;
+      return jstr2mstr(mrb, (jstring)jobj);
     } break;
     case 'c': {
-      return jmeth_i__call_class;
-    } break;
-    case 'c' | FLAG_ARY: {
-      return jmeth_i__call_class_ary;
-    } break;
-    case 'c' | FLAG_STATIC: {
-      return jmeth_i__call_class_static;
-    } break;
-    case 'L': {
-      return jmeth_i__call_obj;
-    } break;
-    case 'L' | FLAG_STATIC: {
-      return jmeth_i__call_obj_static;
-    } break;
-    case 'L' | FLAG_ARY: {
-      return jmeth_i__call_obj_ary;
+      return mrb_mruby_jni_jclass2mclass(mrb, jobj, mobj);
     } break;
   }
-  return NULL;
+  return mrb_mruby_jni_wrap_jobject(mrb, sfield->klass, jobj);
 }
 
-static mrb_value jmeth__initialize(mrb_state *mrb, mrb_value self) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  mrb_value miclass, mclass, mname, mret, margs, msig;
-  jclass jclazz;
-  jmethodID jmeth;
+#define JFIELD_ACCESSORS(name, jtype, member, jname, to_mrb) \
+static mrb_value jfield_i__get_##name(mrb_state *mrb, mrb_value mobj, struct RJField *sfield) { \
+  JNIEnv* env = jni_env(mrb); \
+  jtype jv = (*env)->Get##jname##Field(env, (jobject)DATA_PTR(mobj), sfield->id); \
+  return to_mrb; \
+} \
+static mrb_value jfield_i__get_##name##_static(mrb_state *mrb, mrb_value mobj, struct RJField *sfield) { \
+  JNIEnv* env = jni_env(mrb); \
+  jtype jv = (*env)->GetStatic##jname##Field(env, sfield->jclazz, sfield->id); \
+  return to_mrb; \
+} \
+static void jfield_i__set_##name(mrb_state *mrb, mrb_value mobj, struct RJField *sfield, jvalue *jval) { \
+  JNIEnv* env = jni_env(mrb); \
+  (*env)->Set##jname##Field(env, (jobject)DATA_PTR(mobj), sfield->id, jval->member); \
+} \
+static void jfield_i__set_##name##_static(mrb_state *mrb, mrb_value mobj, struct RJField *sfield, jvalue *jval) { \
+  JNIEnv* env = jni_env(mrb); \
+  (*env)->SetStatic##jname##Field(env, sfield->jclazz, sfield->id, jval->member); \
+}
+
+JFIELD_ACCESSORS(bool, jboolean, z, Boolean, mrb_bool_value(jv))
+JFIELD_ACCESSORS(byte, jbyte, b, Byte, mrb_fixnum_value(jv))
+JFIELD_ACCESSORS(char, jchar, c, Char, mrb_fixnum_value(jv))
+JFIELD_ACCESSORS(short, jshort, s, Short, mrb_fixnum_value(jv))
+JFIELD_ACCESSORS(int, jint, i, Int, mrb_fixnum_value(jv))
+JFIELD_ACCESSORS(long, jlong, j, Long, jlong2mlong(mrb, jv))
+JFIELD_ACCESSORS(float, jfloat, f, Float, mrb_float_value(mrb, jv))
+JFIELD_ACCESSORS(double, jdouble, d, Double, mrb_float_value(mrb, jv))
+JFIELD_ACCESSORS(obj, jobject, l, Object, jfield_jobj2mobj(mrb, mobj, sfield, jv))
+
+#undef JFIELD_ACCESSORS
+
+static mrb_value jfield__initialize(mrb_state *mrb, mrb_value self) {
+  JNIEnv* env = jni_env(mrb);
+  mrb_value miclass, mclass, mtype, mname, msig, mmod;
+  struct RJField *sfield = (struct RJField *)malloc(sizeof(struct RJField));
   char *cname, *csig;
-  struct RJMethod *smeth = (struct RJMethod *)malloc(sizeof(struct RJMethod));
   int is_static = 0;
-  struct RArray *ary;
 
-  DATA_TYPE(self) = &jmeth_data_type;
-  DATA_PTR(self) = smeth;
-  smeth->types = NULL;
+  DATA_TYPE(self) = &jfield_data_type;
+  DATA_PTR(self) = sfield;
+  memset(sfield, 0, sizeof(struct RJField));
 
-  mrb_get_args(mrb, "oooo", &miclass, &mret, &mname, &margs);
+  mrb_get_args(mrb, "ooo", &miclass, &mtype, &mname);
   if (mrb_type(miclass) == MRB_TT_SCLASS) {
     is_static = 1;
     miclass = mrb_iv_get(mrb, miclass, mrb_intern_cstr(mrb, "__attached__"));
   }
   mclass = mrb_iv_get(mrb, miclass, mrb_intern_cstr(mrb, "jclass"));
-  jclazz = DATA_PTR(mclass);
+  sfield->jclazz = DATA_PTR(mclass);
+  sfield->is_static = is_static;
+  mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, "name"), mname);
   cname = mrb_string_value_cstr(mrb, &mname);
 
-  msig = mrb_funcall(mrb, miclass, "get_type", 1, margs);
-  csig = mrb_string_value_cstr(mrb, &msig);
-  smeth->types = (char*)malloc(RSTRING_LEN(msig) + 1);
-  memcpy(smeth->types, csig, RSTRING_LEN(msig) + 1);
-
-  msig = mrb_funcall(mrb, self, "get_sig", 2, mret, margs);
+  mmod = mrb_const_get(mrb, mrb_obj_value(mrb_module_get(mrb, "Jni")), mrb_intern_cstr(mrb, "Object"));
+  msig = mrb_funcall(mrb, mmod, "class2sig", 1, mtype);
   csig = mrb_string_value_cstr(mrb, &msig);
   if (is_static) {
-    jmeth = (*env)->GetStaticMethodID(env, jclazz, cname, csig);
+    sfield->id = (*env)->GetStaticFieldID(env, sfield->jclazz, cname, csig);
   } else {
-    jmeth = (*env)->GetMethodID(env, jclazz, cname, csig);
+    sfield->id = (*env)->GetFieldID(env, sfield->jclazz, cname, csig);
   }
   if ((*env)->ExceptionCheck(env)) {
-    mrb_raisef(mrb, E_NAME_ERROR, "Jni: can't get %S%S", mname, msig);
+    (*env)->ExceptionClear(env);
+    mrb_raisef(mrb, E_NAME_ERROR, "Jni: can't get field %S %S", mname, msig);
   }
 
-  ary = mrb_ary_ptr(margs);
-  smeth->id = jmeth;
-  if (cname[0] == '<') { /* <init> */
-    smeth->opt1.obj = mrb_obj_ptr(mclass);
-    smeth->caller = jmeth_i__call_constructor;
-  } else {
-    struct RClass *rmod = mrb_module_get(mrb, "Jni");
-    int depth = 0;
+  msig = mrb_funcall(mrb, mmod, "class2type", 1, mtype);
+  csig = mrb_string_value_cstr(mrb, &msig);
+  sfield->ftype = csig[0];
+  switch (sfield->ftype) {
+#define JFIELD_CASE(c, name, jop) \
+    case c: { \
+      sfield->get = is_static ? jfield_i__get_##name##_static : jfield_i__get_##name; \
+      sfield->set = is_static ? jfield_i__set_##name##_static : jfield_i__set_##name; \
+      sfield->arg.op = jop; \
+    } break;
+    JFIELD_CASE('Z', bool, JARG_BOOL)
+    JFIELD_CASE('B', byte, JARG_BYTE)
+    JFIELD_CASE('C', char, JARG_CHAR)
+    JFIELD_CASE('S', short, JARG_SHORT)
+    JFIELD_CASE('I', int, JARG_INT)
+    JFIELD_CASE('J', long, JARG_LONG)
+    JFIELD_CASE('F', float, JARG_FLOAT)
+    JFIELD_CASE('D', double, JARG_DOUBLE)
+    JFIELD_CASE('s', obj, JARG_STR)
+#undef JFIELD_CASE
+    case 'L': {
+      sfield->get = is_static ? jfield_i__get_obj_static : jfield_i__get_obj;
+      sfield->set = is_static ? jfield_i__set_obj_static : jfield_i__set_obj;
+      sfield->klass = mrb_class_ptr(mtype);
+      sfield->arg.op = JARG_OBJ;
+      sfield->arg.resolved = 1;
+      sfield->arg.klass = sfield->klass;
+    } break;
+    case 'c': {
+      sfield->get = is_static ? jfield_i__get_obj_static : jfield_i__get_obj;
+    } break;
+    default: {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: unsupported field type: %S (%S)", msig, mname);
+    } break;
+  }
+  return self;
+}
 
-    rmod = mrb_class_ptr(mrb_const_get(mrb, mrb_obj_value(rmod), mrb_intern_cstr(mrb, "Generics")));
-    while (mrb_type(mret) == MRB_TT_ARRAY && RARRAY_LEN(mret)) {
-      depth++;
-      mret = *RARRAY_PTR(mret);
+static void jfield_check_receiver(mrb_state *mrb, mrb_value self, struct RJField *sfield, mrb_value mobj) {
+  if (!sfield->is_static && (!jobj_data_p(mobj) || !DATA_PTR(mobj))) {
+    mrb_value mname = mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "name"));
+
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: no Java object behind receiver of field '%S'", mname);
+  }
+}
+
+static mrb_value jfield__get(mrb_state *mrb, mrb_value self) {
+  struct RJField *sfield = DATA_PTR(self);
+  mrb_value mobj = mrb_nil_value();
+
+  mrb_get_args(mrb, "|o", &mobj);
+  jfield_check_receiver(mrb, self, sfield, mobj);
+  jni_safe_point(mrb);
+  return sfield->get(mrb, mobj, sfield);
+}
+
+static mrb_value jfield__set(mrb_state *mrb, mrb_value self) {
+  JNIEnv* env = jni_env(mrb);
+  struct RJField *sfield = DATA_PTR(self);
+  mrb_value mobj, mval;
+  jvalue jval;
+
+  mrb_get_args(mrb, "oo", &mobj, &mval);
+  if (!sfield->set) {
+    mrb_value mname = mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "name"));
+
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: field '%S' can't be assigned", mname);
+  }
+  jfield_check_receiver(mrb, self, sfield, mobj);
+  jni_safe_point(mrb);
+  if (!mobj2jvalue(mrb, &sfield->arg, mval, &jval)) {
+    mrb_value mname = mrb_iv_get(mrb, self, mrb_intern_cstr(mrb, "name"));
+
+    mrb_raisef(mrb, E_TYPE_ERROR, "Jni: wrong value for field '%S': %S", mname, mval);
+  }
+  sfield->set(mrb, mobj, sfield, &jval);
+  if (mrb_type(mval) == MRB_TT_STRING) {
+    (*env)->DeleteLocalRef(env, jval.l);
+  }
+  return mval;
+}
+
+static mrb_value jfield__static_p(mrb_state *mrb, mrb_value self) {
+  struct RJField *sfield = DATA_PTR(self);
+
+  return mrb_bool_value(sfield->is_static);
+}
+
+static mrb_value jni_s__set_class_path(mrb_state *mrb, mrb_value self) {
+  mrb_value mmod, mpath;
+  mrb_get_args(mrb, "oo", &mmod, &mpath);
+  mrb_iv_set(mrb, mmod, mrb_intern_cstr(mrb, "__classpath__"), mpath);
+  return mrb_nil_value();
+}
+
+static mrb_value jni_s__get_field_static(mrb_state *mrb, mrb_value self) {
+  JNIEnv* env = jni_env(mrb);
+  mrb_value mmod, mstr, mclass, mret, mname;
+  jfieldID fid;
+  jclass jclazz;
+  char *cname, *cstr;
+
+  mmod = mrb_const_get(mrb, self, mrb_intern_cstr(mrb, "Object"));
+  mrb_get_args(mrb, "ooo", &mclass, &mret, &mname);
+  jclazz = DATA_PTR(mrb_iv_get(mrb, mclass, mrb_intern_cstr(mrb, "jclass")));
+
+  cname = mrb_string_value_cstr(mrb, &mname);
+  mstr = mrb_funcall(mrb, mmod, "class2sig", 1, mret);
+  cstr = mrb_string_value_cstr(mrb, &mstr);
+  fid = (*env)->GetStaticFieldID(env, jclazz, cname, cstr);
+  if ((*env)->ExceptionCheck(env)) {
+    mrb_raisef(mrb, E_NAME_ERROR, "Jni: can't get field %S", mstr);
+  }
+
+  mstr = mrb_funcall(mrb, mmod, "class2type", 1, mret);
+  cstr = mrb_string_value_cstr(mrb, &mstr);
+  switch (cstr[0]) {
+    case 'Z': {
+      jboolean jval;
+      jval = (*env)->GetStaticBooleanField(env, jclazz, fid);
+      return jval ? mrb_true_value() : mrb_false_value();
+    } break;
+    case 'I': {
+      jint jval;
+      jval = (*env)->GetStaticIntField(env, jclazz, fid);
+      return mrb_fixnum_value(jval);
+    } break;
+    case 'J': {
+      jlong jval = (*env)->GetStaticLongField(env, jclazz, fid);
+      return jlong2mlong(mrb, jval);
     }
-    smeth->opt1.klass = mrb_class_ptr(mret);
-    if (rmod == smeth->opt1.klass) { /* Generics */
-      miclass = mrb_iv_get(mrb, miclass, mrb_intern_cstr(mrb, "@iclass"));
-      smeth->opt1.klass = mrb_class_ptr(miclass);
+    case 'L': {
+      jobject jval;
+      jval = (*env)->GetStaticObjectField(env, jclazz, fid);
+      return mrb_mruby_jni_wrap_jobject(mrb, mrb_class_ptr(mret), jval);
+    } break;
+    case 's': {
+      jstring jstr;
+      jstr = (*env)->GetStaticObjectField(env, jclazz, fid);
+      return jstr2mstr(mrb, jstr);
+    } break;
+  }
+  mclass = mrb_funcall(mrb, mclass, "inspect", 0);
+  mrb_raisef(mrb, E_RUNTIME_ERROR, "unsupported field: %S (%S in %S)", mstr, mname, mclass);
+  return mrb_nil_value();
+}
+
+static mrb_value jni_s__debug(mrb_state *mrb, mrb_value self) {
+  debug = !debug;
+  return mrb_nil_value();
+}
+
+static mrb_value jni_s__flush_refs(mrb_state *mrb, mrb_value self) {
+  return mrb_fixnum_value(jni_flush_refs(mrb));
+}
+
+static mrb_value jni_s__release_threshold(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+
+  return mrb_fixnum_value(ctx->release_threshold);
+}
+
+static mrb_value jni_s__set_release_threshold(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_int threshold;
+
+  mrb_get_args(mrb, "i", &threshold);
+  if (threshold < 0 || threshold > ctx->release_limit) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "Jni: release threshold must be between 0 and %S", mrb_fixnum_value(ctx->release_limit));
+  }
+  jni_flush_refs(mrb);
+  ctx->release_threshold = threshold;
+  return mrb_fixnum_value(threshold);
+}
+
+static mrb_value jni_s__release_limit(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+
+  return mrb_fixnum_value(ctx->release_limit);
+}
+
+static mrb_value jni_s__set_release_limit(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_int limit;
+
+  mrb_get_args(mrb, "i", &limit);
+  if (limit < 1) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "Jni: release limit must be positive");
+  }
+  jni_flush_refs(mrb);
+  free(ctx->release_queue);
+  ctx->release_queue = NULL;
+  ctx->release_limit = limit;
+  if (ctx->release_threshold > limit) {
+    ctx->release_threshold = limit;
+  }
+  return mrb_fixnum_value(limit);
+}
+
+static mrb_value jni_s__push_local_frame(mrb_state *mrb, mrb_value self) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mscopes;
+  mrb_int capa;
+
+  mrb_get_args(mrb, "i", &capa);
+  if ((*env)->PushLocalFrame(env, capa) != 0) {
+    (*env)->ExceptionClear(env);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: can't push local frame of %S", mrb_fixnum_value(capa));
+  }
+  mscopes = jni_local_scopes(mrb);
+  if (mrb_nil_p(mscopes)) {
+    mscopes = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, "__local_scopes__"), mscopes);
+  }
+  mrb_ary_push(mrb, mscopes, mrb_ary_new(mrb));
+  ctx->scope_depth++;
+  return mrb_nil_value();
+}
+
+/* pop the local scope; the result escapes, other wrappers are detached */
+static mrb_value jni_s__pop_local_frame(mrb_state *mrb, mrb_value self) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mret, mscopes, mscope;
+  int i;
+
+  mrb_get_args(mrb, "o", &mret);
+  if (!ctx->scope_depth) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: no local scope to leave");
+  }
+  if (mrb_type(mret) == MRB_TT_ARRAY) {
+    for (i = 0; i < RARRAY_LEN(mret); i++) {
+      jobj_promote(mrb, RARRAY_PTR(mret)[i]);
     }
+  } else {
+    jobj_promote(mrb, mret);
+  }
 
-    msig = mrb_funcall(mrb, miclass, "class2type", 1, mret);
-    csig = mrb_string_value_cstr(mrb, &msig);
-    smeth->caller = type2caller(csig, is_static, depth);
-    smeth->opt2.depth = depth;
-    if (!smeth->caller) {
-      mrb_value mstatic = mrb_str_new_cstr(mrb, is_static ? "static " : "");
-      mrb_value misary = mrb_str_new_cstr(mrb, depth ? "array " : "");
-      mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: unsupported return type: %S%S%S", mstatic, misary, msig);
+  mscopes = jni_local_scopes(mrb);
+  mscope = mrb_ary_pop(mrb, mscopes);
+  for (i = 0; i < RARRAY_LEN(mscope); i++) {
+    mrb_value mobj = RARRAY_PTR(mscope)[i];
+
+    if (DATA_TYPE(mobj) == &jobj_local_data_type) {
+      DATA_PTR(mobj) = NULL;
+      DATA_TYPE(mobj) = &jobj_data_type;
     }
   }
-  smeth->argc = ary->len;
-  smeth->argv = (jvalue *)malloc(ary->len * sizeof(jvalue));
-  DATA_TYPE(self) = &jmeth_data_type;
-  DATA_PTR(self) = smeth;
+  ctx->scope_depth--;
+  (*env)->PopLocalFrame(env, NULL);
+  return mret;
+}
+
+static mrb_value jni_s__promote(mrb_state *mrb, mrb_value self) {
+  mrb_value mobj;
+
+  mrb_get_args(mrb, "o", &mobj);
+  jobj_promote(mrb, mobj);
+  return mobj;
+}
+
+/* direct ByteBuffers over Jni::Buffer memory, which the wrapper keeps alive */
+static mrb_value jni_direct_buffer(mrb_state *mrb, void *ptr, mrb_int len, mrb_value msrc, struct RClass *klass) {
+  JNIEnv* env = jni_env(mrb);
+  mrb_value mbuf;
+  jobject jbuf;
+
+  jbuf = (*env)->NewDirectByteBuffer(env, ptr, len);
+  if (!jbuf) {
+    (*env)->ExceptionClear(env);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: direct buffers are not supported by this VM");
+  }
+  mbuf = mrb_mruby_jni_wrap_jobject(mrb, klass, jbuf);
+  mrb_iv_set(mrb, mbuf, mrb_intern_cstr(mrb, "__buffer_source__"), msrc);
+  return mbuf;
+}
+
+struct RJBuffer {
+  mrb_int size;
+  char ptr[1];
+};
+
+/* a String may be shared or resized, so its bytes are copied into a Jni::Buffer */
+static mrb_value jni_s__direct_buffer(mrb_state *mrb, mrb_value self) {
+  mrb_value mstr, mclass = mrb_nil_value(), msize, mjbuf;
+  struct RJBuffer *sbuf;
+  struct RClass *klass;
+
+  mrb_get_args(mrb, "S|o", &mstr, &mclass);
+  klass = mrb_nil_p(mclass) ? mrb_class_get_under(mrb, mrb_class_ptr(self), "Object") : mrb_class_ptr(mclass);
+  msize = mrb_fixnum_value(RSTRING_LEN(mstr));
+  mjbuf = mrb_obj_new(mrb, mrb_class_get_under(mrb, mrb_class_ptr(self), "Buffer"), 1, &msize);
+  sbuf = (struct RJBuffer *)DATA_PTR(mjbuf);
+  memcpy(sbuf->ptr, RSTRING_PTR(mstr), RSTRING_LEN(mstr));
+  return jni_direct_buffer(mrb, sbuf->ptr, sbuf->size, mjbuf, klass);
+}
+
+static void jbuf_free(mrb_state *mrb, void *p) {
+  free(p);
+}
+
+static const struct mrb_data_type jbuf_data_type = {
+  "jbuffer", jbuf_free,
+};
 
+static mrb_value jbuf__initialize(mrb_state *mrb, mrb_value self) {
+  struct RJBuffer *sbuf;
+  mrb_int size;
+
+  DATA_TYPE(self) = &jbuf_data_type;
+  DATA_PTR(self) = NULL;
+  mrb_get_args(mrb, "i", &size);
+  if (size < 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "Jni: negative buffer size");
+  }
+  sbuf = (struct RJBuffer *)calloc(1, sizeof(struct RJBuffer) + size);
+  if (!sbuf) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: can't allocate buffer of %S bytes", mrb_fixnum_value(size));
+  }
+  sbuf->size = size;
+  DATA_PTR(self) = sbuf;
   return self;
 }
 
-static mrb_value jmeth__types(mrb_state *mrb, mrb_value self) {
-  struct RJMethod *smeth = DATA_PTR(self);
+static mrb_value jbuf__size(mrb_state *mrb, mrb_value self) {
+  struct RJBuffer *sbuf = DATA_PTR(self);
+
+  return mrb_fixnum_value(sbuf->size);
+}
+
+static mrb_value jbuf__read(mrb_state *mrb, mrb_value self) {
+  struct RJBuffer *sbuf = DATA_PTR(self);
+  mrb_int offset = 0, len = -1;
+
+  mrb_get_args(mrb, "|ii", &offset, &len);
+  if (len < 0) {
+    len = sbuf->size - offset;
+  }
+  if (offset < 0 || len < 0 || offset + len > sbuf->size) {
+    mrb_raisef(mrb, E_INDEX_ERROR, "Jni: read outside buffer");
+  }
+  return mrb_str_new(mrb, sbuf->ptr + offset, len);
+}
+
+static mrb_value jbuf__write(mrb_state *mrb, mrb_value self) {
+  struct RJBuffer *sbuf = DATA_PTR(self);
+  mrb_int offset;
+  mrb_value mstr;
+
+  mrb_get_args(mrb, "iS", &offset, &mstr);
+  if (offset < 0 || offset + RSTRING_LEN(mstr) > sbuf->size) {
+    mrb_raisef(mrb, E_INDEX_ERROR, "Jni: write outside buffer");
+  }
+  memcpy(sbuf->ptr + offset, RSTRING_PTR(mstr), RSTRING_LEN(mstr));
+  return mrb_fixnum_value(RSTRING_LEN(mstr));
+}
+
+static mrb_value jbuf__byte_buffer(mrb_state *mrb, mrb_value self) {
+  struct RJBuffer *sbuf = DATA_PTR(self);
+  mrb_value mclass = mrb_nil_value();
+  struct RClass *klass;
+
+  mrb_get_args(mrb, "|o", &mclass);
+  klass = mrb_nil_p(mclass) ? mrb_class_get_under(mrb, mrb_module_get(mrb, "Jni"), "Object") : mrb_class_ptr(mclass);
+  return jni_direct_buffer(mrb, sbuf->ptr, sbuf->size, self, klass);
+}
+
+/* Jni.string_benchmark(str, n): ns per Java-to-mruby conversion of str, per method */
+static mrb_value jni_s__string_benchmark(mrb_state *mrb, mrb_value self) {
+  JNIEnv* env = jni_env(mrb);
+  mrb_value mstr, mhash;
+  mrb_int n, i;
+  jstring jstr;
+  double t;
+  int ai;
+
+  mrb_get_args(mrb, "Si", &mstr, &n);
+  if (n <= 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "Jni: iteration count must be positive");
+  }
+  jstr = mstr2jstr(mrb, mstr);
+  mhash = mrb_hash_new(mrb);
+  ai = mrb_gc_arena_save(mrb);
+
+  t = jni_now_ns();
+  for (i = 0; i < n; i++) {
+    jsize size = (*env)->GetStringUTFLength(env, jstr);
+    const char *cstr = (*env)->GetStringUTFChars(env, jstr, NULL);
+
+    mrb_str_new(mrb, cstr, size);
+    (*env)->ReleaseStringUTFChars(env, jstr, cstr);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  mrb_hash_set(mrb, mhash, mrb_str_new_cstr(mrb, "utf_chars"), mrb_float_value(mrb, (jni_now_ns() - t) / n));
+
+  t = jni_now_ns();
+  for (i = 0; i < n; i++) {
+    jsize size = (*env)->GetStringUTFLength(env, jstr);
+    mrb_value mout = mrb_str_buf_new(mrb, size + 1);
+
+    (*env)->GetStringUTFRegion(env, jstr, 0, (*env)->GetStringLength(env, jstr), RSTRING_PTR(mout));
+    mrb_str_resize(mrb, mout, size);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  mrb_hash_set(mrb, mhash, mrb_str_new_cstr(mrb, "utf_region"), mrb_float_value(mrb, (jni_now_ns() - t) / n));
+
+  t = jni_now_ns();
+  for (i = 0; i < n; i++) {
+    jstr2mstr(mrb, (*env)->NewLocalRef(env, jstr));
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  mrb_hash_set(mrb, mhash, mrb_str_new_cstr(mrb, "utf16"), mrb_float_value(mrb, (jni_now_ns() - t) / n));
+
+  (*env)->DeleteLocalRef(env, jstr);
+  return mhash;
+}
+
+static mrb_value jni_s__string_cache(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+
+  return mrb_fixnum_value(ctx->jstr_cache_sets * JSTR_CACHE_WAYS);
+}
+
+static mrb_value jni_s__set_string_cache(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_int capa;
+  int sets;
+
+  mrb_get_args(mrb, "i", &capa);
+  if (capa < 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "Jni: negative string cache size");
+  }
+  jstr_cache_clear(mrb);
+  sets = (capa + JSTR_CACHE_WAYS - 1) / JSTR_CACHE_WAYS;
+  if (sets) {
+    ctx->jstr_cache = (struct jstr_cache_entry *)calloc(sets * JSTR_CACHE_WAYS, sizeof(struct jstr_cache_entry));
+    if (!ctx->jstr_cache) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: can't allocate string cache of %S entries", mrb_fixnum_value(capa));
+    }
+    ctx->jstr_cache_sets = sets;
+  }
+  return mrb_fixnum_value(sets * JSTR_CACHE_WAYS);
+}
+
+static mrb_value jni_s__string_cache_stats(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mhash = mrb_hash_new(mrb);
+  int i, size = 0;
+
+  for (i = 0; i < ctx->jstr_cache_sets * JSTR_CACHE_WAYS; i++) {
+    if (ctx->jstr_cache[i].jstr) {
+      size++;
+    }
+  }
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "hits")), mrb_fixnum_value(ctx->jstr_hits));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "misses")), mrb_fixnum_value(ctx->jstr_misses));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "evictions")), mrb_fixnum_value(ctx->jstr_evictions));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "size")), mrb_fixnum_value(size));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "capacity")), mrb_fixnum_value(ctx->jstr_cache_sets * JSTR_CACHE_WAYS));
+  return mhash;
+}
+
+static mrb_value jni_s__identity_map(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+
+  return mrb_bool_value(ctx->idmap != NULL);
+}
+
+/* wrappers created while the map is off are never mapped */
+static mrb_value jni_s__set_identity_map(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mflag;
+
+  mrb_get_args(mrb, "o", &mflag);
+  if (mrb_test(mflag) && !ctx->idmap) {
+    jni_identity_init(mrb);
+    if (!jidmap_alloc(ctx, JIDMAP_MIN)) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: can't allocate the identity map");
+    }
+    ctx->idmap_len = 0;
+  } else if (!mrb_test(mflag) && ctx->idmap) {
+    jidmap_clear(ctx);
+  }
+  return mflag;
+}
+
+static mrb_value jni_s__identity_map_stats(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mhash = mrb_hash_new(mrb);
 
-  return mrb_str_new_cstr(mrb, smeth->types);
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "hits")), mrb_fixnum_value(ctx->idmap_hits));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "misses")), mrb_fixnum_value(ctx->idmap_misses));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "size")), mrb_fixnum_value(ctx->idmap_len));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "capacity")), mrb_fixnum_value(ctx->idmap_capa));
+  return mhash;
 }
 
-#define TYPE_VAL(c, mtype) (((int)(unsigned char)c) | ((mtype) << 8))
-
-static char *mobj2jvalue(mrb_state *mrb, char *types, mrb_value mobj, jvalue *jval) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
+static mrb_value jni_s__track_refs(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
 
-  switch (TYPE_VAL(*types++, mrb_type(mobj))) {
-    case TYPE_VAL('Z', MRB_TT_FALSE):
-    case TYPE_VAL('Z', MRB_TT_TRUE): {
-      if (jval) {
-        jval->z = mrb_bool(mobj);
-      }
-    } break;
-    case TYPE_VAL('I', MRB_TT_FIXNUM): {
-      if (jval) {
-        jval->i = mrb_fixnum(mobj);
-      }
-    } break;
-    case TYPE_VAL('F', MRB_TT_FLOAT): {
-      if (jval) {
-        jval->f = mrb_float(mobj);
-      }
-    } break;
-    case TYPE_VAL('F', MRB_TT_FIXNUM): {
-      if (jval) {
-        jval->f = mrb_fixnum(mobj);
-      }
-    } break;
-    case TYPE_VAL('L', MRB_TT_STRING):
-    case TYPE_VAL('s', MRB_TT_STRING): {
-      if (jval) {
-        jval->l = (jobject)(*env)->NewStringUTF(env, mrb_string_value_cstr(mrb, &mobj));
-      }
-    } break;
-    case TYPE_VAL('L', MRB_TT_FALSE): {
-      types = strchr(types, ';') + 1;
-      if (jval) {
-        jval->l = (jobject)NULL;
-      }
-    } break;
-    case TYPE_VAL('L', MRB_TT_DATA): {
-      char *cname = types;
-      mrb_value mclass;
+  return mrb_bool_value(ctx->jref_table != NULL);
+}
 
-      types = strchr(types, ';');
-      mclass = mrb_str_new(mrb, cname, (types++) - cname);
-      mclass = mrb_funcall(mrb, mobj, "name2class", 1, mclass);
-      if (mrb_nil_p(mclass)) {
-        return NULL;
-      }
-      if (!mrb_obj_is_kind_of(mrb, mobj, mrb_class_ptr(mclass))) {
-        return NULL;
-      }
-      if (jval) {
-        jval->l = (jobject)DATA_PTR(mobj);
-      }
-    } break;
-    case TYPE_VAL('[', MRB_TT_ARRAY): {
-      struct RArray *ary;
-      int i, size, len;
-      jarray jary = NULL;
-      char *head, *ptr = NULL;
-
-      head = types;
-      ary = mrb_ary_ptr(mobj);
-      len = ary->len;
-      switch (*head) {
-        case 'F': {
-          if (jval) {
-            jary = (*env)->NewFloatArray(env, len);
-            size = sizeof(jfloat);
-            ptr = (char*)(*env)->GetFloatArrayElements(env, jary, NULL);
-          }
-        } break;
-        default: {
-          return NULL;
-        }
-      }
-      for (i = 0; i < len; i++) {
-        mrb_value mitem = ary->ptr[i];
-        jvalue *jarg = NULL;
+/* refs created before tracking starts are only counted in :live */
+static mrb_value jni_s__set_track_refs(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mflag;
 
-        if (jval) {
-          jarg = (jvalue*)(ptr + i * size);
-        }
-        types = mobj2jvalue(mrb, head, mitem, jarg);
-        if (!types) {
-          return NULL;
-        }
-      }
-      switch (*head) {
-        case 'F': {
-          if (jval) {
-            (*env)->ReleaseFloatArrayElements(env, jary, (jfloat*)ptr, 0);
-          }
-        } break;
-        default: {
-          return NULL;
-        }
-      }
-      if (jval) {
-        jval->l = jary;
-      }
-    } break;
-    default: {
-      return NULL;
+  mrb_get_args(mrb, "o", &mflag);
+  if (mrb_test(mflag) && !ctx->jref_table) {
+    ctx->jref_table = (struct jref_entry *)calloc(JREF_TABLE_MIN, sizeof(struct jref_entry));
+    if (!ctx->jref_table) {
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "Jni: can't allocate the ref table");
     }
+    ctx->jref_capa = JREF_TABLE_MIN;
+    ctx->jref_len = 0;
+    memset(ctx->jref_by_origin, 0, sizeof(ctx->jref_by_origin));
+  } else if (!mrb_test(mflag) && ctx->jref_table) {
+    free(ctx->jref_table);
+    ctx->jref_table = NULL;
+    ctx->jref_capa = 0;
+    ctx->jref_len = 0;
+    memset(ctx->jref_by_origin, 0, sizeof(ctx->jref_by_origin));
   }
+  return mflag;
+}
 
-  return types;
+static mrb_value jni_s__ref_soft_limit(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+
+  return mrb_fixnum_value(ctx->gref_soft_limit);
 }
 
-static mrb_value jmeth__check(mrb_state *mrb, mrb_value self) {
-  mrb_value margs;
-  struct RJMethod *smeth = DATA_PTR(self);
-  struct RArray *ary;
-  int i;
-  char *types = smeth->types;
+static mrb_value jni_s__set_ref_soft_limit(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_int limit;
 
-  mrb_get_args(mrb, "o", &margs);
-  ary = mrb_ary_ptr(margs);
-  if (ary->len != smeth->argc) {
-    return mrb_false_value();
+  mrb_get_args(mrb, "i", &limit);
+  if (limit < 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "Jni: soft limit must not be negative");
   }
-  for (i = 0; i < ary->len; i++) {
-    smeth->argv[i].i = 0;
+  ctx->gref_soft_limit = limit;
+  ctx->gref_trigger = limit;
+  return mrb_fixnum_value(limit);
+}
+
+/* counts cover refs owned by mruby objects only, see enum jref_origin */
+static mrb_value jni_s__ref_stats(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mhash = mrb_hash_new(mrb);
+  mrb_value morigins = mrb_hash_new(mrb);
+  int i;
+
+  for (i = 0; i < JREF_ORIGINS; i++) {
+    mrb_hash_set(mrb, morigins, mrb_symbol_value(mrb_intern_cstr(mrb, jref_origin_names[i])), mrb_fixnum_value(ctx->jref_by_origin[i]));
   }
-  for (i = 0; i < ary->len; i++) {
-    mrb_value item = ary->ptr[i];
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "live")), mrb_fixnum_value(ctx->gref_live));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "high_watermark")), mrb_fixnum_value(ctx->gref_high));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "pending_release")), mrb_fixnum_value(ctx->release_len));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "soft_limit")), mrb_fixnum_value(ctx->gref_soft_limit));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "gc_runs")), mrb_fixnum_value(ctx->gref_gc_runs));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "tracked")), mrb_fixnum_value(ctx->jref_len));
+  mrb_hash_set(mrb, mhash, mrb_symbol_value(mrb_intern_cstr(mrb, "by_origin")), morigins);
+  return mhash;
+}
 
-    types = mobj2jvalue(mrb, types, item, NULL);
-    if (!types) {
-      return mrb_false_value();
+/* Jni.ref_dump: { klass => { origin => count } }, unbound classes under nil */
+static mrb_value jni_s__ref_dump(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mhash = mrb_hash_new(mrb);
+  int i, ai = mrb_gc_arena_save(mrb);
+
+  for (i = 0; i < ctx->jref_capa; i++) {
+    struct jref_entry *entry = ctx->jref_table + i;
+    mrb_value mkey, mcounts, morigin, mcount;
+
+    if (!entry->ref) {
+      continue;
+    }
+    mkey = entry->klass ? mrb_obj_value(entry->klass) : mrb_nil_value();
+    mcounts = mrb_hash_get(mrb, mhash, mkey);
+    if (mrb_nil_p(mcounts)) {
+      mcounts = mrb_hash_new(mrb);
+      mrb_hash_set(mrb, mhash, mkey, mcounts);
     }
+    morigin = mrb_symbol_value(mrb_intern_cstr(mrb, jref_origin_names[entry->origin]));
+    mcount = mrb_hash_get(mrb, mcounts, morigin);
+    mrb_hash_set(mrb, mcounts, morigin, mrb_fixnum_value(mrb_nil_p(mcount) ? 1 : mrb_fixnum(mcount) + 1));
+    mrb_gc_arena_restore(mrb, ai);
   }
-  return mrb_true_value();
+  return mhash;
 }
 
-static mrb_value jmeth__call(mrb_state *mrb, mrb_value self) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  mrb_value mobj, mname, margs;
-  struct RJMethod *smeth;
-  int i;
-  char *types;
-  struct RArray *ary;
+#if MRUBY_JNI_STATS
+#define JSTATS_SET(key, val) \
+  mrb_hash_set(mrb, mentry, mrb_symbol_value(mrb_intern_cstr(mrb, key)), (val))
 
-  smeth = DATA_PTR(self);
-  mrb_get_args(mrb, "ooo", &mobj, &mname, &margs);
-  ary = mrb_ary_ptr(margs);
-  types = smeth->types;
+/* { "path#name(sig)" => { calls: n, ... } } for methods used since the last reset */
+static mrb_value jstats_hash(mrb_state *mrb) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  struct jmeth_stats *stats;
+  mrb_value mhash = mrb_hash_new(mrb);
+  int ai = mrb_gc_arena_save(mrb);
 
-  for (i = 0; i < ary->len; i++) {
-    mrb_value item = ary->ptr[i];
-    jvalue *jarg = smeth->argv + i;
+  for (stats = ctx->stats_list.next; stats != &ctx->stats_list; stats = stats->next) {
+    mrb_value mentry;
 
-    types = mobj2jvalue(mrb, types, item, jarg);
-    if (!types) {
-      return mrb_false_value();
+    if (!stats->calls && !stats->check_misses) {
+      continue;
     }
+    mentry = mrb_hash_new(mrb);
+    JSTATS_SET("calls", mrb_fixnum_value(stats->calls));
+    JSTATS_SET("check_misses", mrb_fixnum_value(stats->check_misses));
+    JSTATS_SET("marshal_ns", mrb_float_value(mrb, stats->marshal_ns));
+    JSTATS_SET("java_ns", mrb_float_value(mrb, stats->java_ns));
+    JSTATS_SET("transitions", mrb_fixnum_value(stats->transitions));
+    JSTATS_SET("strings", mrb_fixnum_value(stats->strings));
+    JSTATS_SET("global_refs", mrb_fixnum_value(stats->global_refs));
+    mrb_hash_set(mrb, mhash, mrb_str_new_cstr(mrb, stats->label ? stats->label : "?"), mentry);
+    mrb_gc_arena_restore(mrb, ai);
   }
-  mobj = smeth->caller(mrb, mobj, smeth);
-  for (i = 0; i < smeth->argc; i++) {
-    mrb_value mitem = ary->ptr[i];
-    jvalue *jarg = smeth->argv + i;
-    switch (mrb_type(mitem)) {
-      case MRB_TT_STRING: {
-        (*env)->DeleteLocalRef(env, jarg->l);
-      } break;
+  return mhash;
+}
+
+#undef JSTATS_SET
+
+/* hand Jni.stats to the Jni.stats_dump block, or print it to stderr */
+static void jstats_dump(mrb_state *mrb) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  struct RClass *mod = mrb_module_get(mrb, "Jni");
+  mrb_value mblk = mrb_iv_get(mrb, mrb_obj_value(mod), mrb_intern_cstr(mrb, "__stats_dump__"));
+  struct jmeth_stats *stats;
+  int ai;
+
+  ctx->stats_dumping = 1;
+  if (!mrb_nil_p(mblk)) {
+    ai = mrb_gc_arena_save(mrb);
+    mrb_yield(mrb, mblk, jstats_hash(mrb));
+    mrb_gc_arena_restore(mrb, ai);
+  } else {
+    for (stats = ctx->stats_list.next; stats != &ctx->stats_list; stats = stats->next) {
+      if (!stats->calls && !stats->check_misses) {
+        continue;
+      }
+      fprintf(stderr, "mruby-jni: %s calls=%lu check_misses=%lu marshal_ns=%.0f java_ns=%.0f"
+              " transitions=%lu strings=%lu global_refs=%lu\n",
+              stats->label ? stats->label : "?", stats->calls, stats->check_misses,
+              stats->marshal_ns, stats->java_ns, stats->transitions, stats->strings, stats->global_refs);
     }
   }
-  if ((*env)->ExceptionCheck(env)) {
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "exception in java method '%S'", mname);
-  }
-  return mobj;
+  ctx->stats_dumping = 0;
 }
 
-static mrb_value jni_s__set_class_path(mrb_state *mrb, mrb_value self) {
-  mrb_value mmod, mpath;
-  mrb_get_args(mrb, "oo", &mmod, &mpath);
-  mrb_iv_set(mrb, mmod, mrb_intern_cstr(mrb, "__classpath__"), mpath);
-  return mrb_nil_value();
+static mrb_value jni_s__stats(mrb_state *mrb, mrb_value self) {
+  return jstats_hash(mrb);
 }
 
-static mrb_value jni_s__get_field_static(mrb_state *mrb, mrb_value self) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
-  mrb_value mmod, mstr, mclass, mret, mname;
-  jfieldID fid;
-  jclass jclazz;
-  char *cname, *cstr;
+static mrb_value jni_s__stats_enabled(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
 
-  mmod = mrb_const_get(mrb, self, mrb_intern_cstr(mrb, "Object"));
-  mrb_get_args(mrb, "ooo", &mclass, &mret, &mname);
-  jclazz = DATA_PTR(mrb_iv_get(mrb, mclass, mrb_intern_cstr(mrb, "jclass")));
+  return mrb_bool_value(ctx->stats_on);
+}
 
-  cname = mrb_string_value_cstr(mrb, &mname);
-  mstr = mrb_funcall(mrb, mmod, "class2sig", 1, mret);
-  cstr = mrb_string_value_cstr(mrb, &mstr);
-  fid = (*env)->GetStaticFieldID(env, jclazz, cname, cstr);
-  if ((*env)->ExceptionCheck(env)) {
-    mrb_raisef(mrb, E_NAME_ERROR, "Jni: can't get field %S", mstr);
-  }
+static mrb_value jni_s__set_stats_enabled(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mflag;
 
-  mstr = mrb_funcall(mrb, mmod, "class2type", 1, mret);
-  cstr = mrb_string_value_cstr(mrb, &mstr);
-  switch (cstr[0]) {
-    case 'Z': {
-      jboolean jval;
-      jval = (*env)->GetStaticBooleanField(env, jclazz, fid);
-      return jval ? mrb_true_value() : mrb_false_value();
-    } break;
-    case 'I': {
-      jint jval;
-      jval = (*env)->GetStaticIntField(env, jclazz, fid);
-      return mrb_fixnum_value(jval);
-    } break;
-    case 'J': {
-      jlong jval = (*env)->GetStaticLongField(env, jclazz, fid);
-      return jlong2mlong(mrb, jval);
-    }
-    case 'L': {
-      jobject jval;
-      jval = (*env)->GetStaticObjectField(env, jclazz, fid);
-      return mrb_mruby_jni_wrap_jobject(mrb, mrb_class_ptr(mret), jval);
-    } break;
-    case 's': {
-      jstring jstr;
-      jstr = (*env)->GetStaticObjectField(env, jclazz, fid);
-      return jstr2mstr(mrb, jstr);
-    } break;
+  mrb_get_args(mrb, "o", &mflag);
+  ctx->stats_on = mrb_test(mflag);
+  return mflag;
+}
+
+static mrb_value jni_s__reset_stats(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  struct jmeth_stats *stats;
+
+  for (stats = ctx->stats_list.next; stats != &ctx->stats_list; stats = stats->next) {
+    stats->calls = stats->check_misses = 0;
+    stats->transitions = stats->strings = stats->global_refs = 0;
+    stats->marshal_ns = stats->java_ns = 0;
   }
-  mclass = mrb_funcall(mrb, mclass, "inspect", 0);
-  mrb_raisef(mrb, E_RUNTIME_ERROR, "unsupported field: %S (%S in %S)", mstr, mname, mclass);
+  ctx->stats_calls = 0;
   return mrb_nil_value();
 }
 
-static mrb_value jni_s__debug(mrb_state *mrb, mrb_value self) {
-  debug = !debug;
-  return mrb_nil_value();
+/* Jni.stats_dump(every) { |stats| ... }: dump every `every` calls, 0 turns it off */
+static mrb_value jni_s__stats_dump(mrb_state *mrb, mrb_value self) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mblk;
+  mrb_int every;
+
+  mrb_get_args(mrb, "i&", &every, &mblk);
+  if (every < 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "Jni: dump interval must not be negative");
+  }
+  mrb_iv_set(mrb, self, mrb_intern_cstr(mrb, "__stats_dump__"), mblk);
+  ctx->stats_dump_every = every;
+  ctx->stats_dumping = 0;
+  return mrb_fixnum_value(every);
 }
+#endif
 
 static mrb_value jni_s__clear_exception(mrb_state *mrb, mrb_value self) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
+  JNIEnv* env = jni_env(mrb);
 
   (*env)->ExceptionClear(env);
   return mrb_nil_value();
 }
 
+static struct RClass *jni_define(mrb_state *mrb);
+#ifdef MRUBY_JNI_BINDINGS
+void mrb_mruby_jni_bindings_init(mrb_state *mrb);
+#endif
+
+struct RClass *mrb_mruby_jni_init_vm(mrb_state *mrb, JavaVM *vm) {
+  struct mrb_jni_context *ctx;
+
+  pthread_once(&jni_key_once, jni_key_init);
+  ctx = (struct mrb_jni_context *)malloc(sizeof(struct mrb_jni_context));
+  if (!ctx) {
+    return NULL;
+  }
+  ctx->magic = JNI_CONTEXT_MAGIC;
+  ctx->vm = vm;
+  ctx->release_queue = NULL;
+  ctx->release_len = 0;
+  ctx->release_threshold = RELEASE_THRESHOLD;
+  ctx->release_limit = RELEASE_LIMIT;
+  ctx->scope_depth = 0;
+  ctx->jstr_cache = NULL;
+  ctx->jstr_cache_sets = 0;
+  ctx->jstr_clock = 0;
+  ctx->jstr_hits = 0;
+  ctx->jstr_misses = 0;
+  ctx->jstr_evictions = 0;
+  ctx->exc_map = NULL;
+  ctx->exc_map_len = 0;
+  ctx->exc_backtrace = 1;
+  ctx->runtime_exception = NULL;
+  ctx->throwable_to_string = NULL;
+  ctx->throwable_get_stack_trace = NULL;
+  ctx->frame_to_string = NULL;
+  ctx->class_cache = NULL;
+  ctx->class_pin = NULL;
+  ctx->system_class = NULL;
+  ctx->identity_hash = NULL;
+  ctx->class_get_name = NULL;
+  ctx->manifest = NULL;
+  ctx->manifest_recording = 0;
+  ctx->gref_live = 0;
+  ctx->gref_high = 0;
+  ctx->gref_soft_limit = 0;
+  ctx->gref_trigger = 0;
+  ctx->gref_gc_runs = 0;
+  ctx->gref_gc_pending = 0;
+  ctx->jref_table = NULL;
+  ctx->jref_capa = 0;
+  ctx->jref_len = 0;
+  memset(ctx->jref_by_origin, 0, sizeof(ctx->jref_by_origin));
+  ctx->idmap = NULL;
+  ctx->idmap_refs = NULL;
+  ctx->idmap_capa = 0;
+  ctx->idmap_len = 0;
+  ctx->idmap_hits = 0;
+  ctx->idmap_misses = 0;
+#if MRUBY_JNI_STATS
+  ctx->stats_on = 0;
+  ctx->stats_cur = NULL;
+  memset(&ctx->stats_list, 0, sizeof(ctx->stats_list));
+  ctx->stats_list.prev = ctx->stats_list.next = &ctx->stats_list;
+  ctx->stats_calls = 0;
+  ctx->stats_dump_every = 0;
+  ctx->stats_dumping = 0;
+#endif
+  jni_vm = vm;
+  mrb->ud = ctx;
+  pthread_setspecific(jni_state_key, mrb);
+  return jni_define(mrb);
+}
+
 struct RClass *mrb_mruby_jni_init(mrb_state *mrb) {
+  JNIEnv* env = (JNIEnv*)mrb->ud;
+  JavaVM *vm;
+
+  pthread_once(&jni_key_once, jni_key_init);
+  (*env)->GetJavaVM(env, &vm);
+  pthread_setspecific(jni_env_key, env);
+  return mrb_mruby_jni_init_vm(mrb, vm);
+}
+
+static struct RClass *jni_define(mrb_state *mrb) {
   struct RClass *klass, *mod;
   mod = mrb_define_module(mrb,
     "Jni");
@@ -813,6 +4726,42 @@ struct RClass *mrb_mruby_jni_init(mrb_state *mrb) {
   mrb_define_singleton_method(mrb, (struct RObject *)mod, "get_field_static", jni_s__get_field_static, ARGS_REQ(3));
   mrb_define_singleton_method(mrb, (struct RObject *)mod, "debug", jni_s__debug, ARGS_NONE());
   mrb_define_singleton_method(mrb, (struct RObject *)mod, "clear_exception", jni_s__clear_exception, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "map_exception", jni_s__map_exception, ARGS_REQ(2));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "warmup", jni_s__warmup, ARGS_REQ(1) | ARGS_OPT(1));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "warmup_stats", jni_s__warmup_stats, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "manifest_record=", jni_s__set_manifest_record, ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "save_manifest", jni_s__save_manifest, ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "exception_backtrace", jni_s__exception_backtrace, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "exception_backtrace=", jni_s__set_exception_backtrace, ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "flush_refs", jni_s__flush_refs, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "release_threshold", jni_s__release_threshold, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "release_threshold=", jni_s__set_release_threshold, ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "release_limit", jni_s__release_limit, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "release_limit=", jni_s__set_release_limit, ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "identity_map", jni_s__identity_map, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "identity_map=", jni_s__set_identity_map, ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "identity_map_stats", jni_s__identity_map_stats, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "track_refs", jni_s__track_refs, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "track_refs=", jni_s__set_track_refs, ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "ref_soft_limit", jni_s__ref_soft_limit, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "ref_soft_limit=", jni_s__set_ref_soft_limit, ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "ref_stats", jni_s__ref_stats, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "ref_dump", jni_s__ref_dump, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "push_local_frame", jni_s__push_local_frame, ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "pop_local_frame", jni_s__pop_local_frame, ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "promote", jni_s__promote, ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "direct_buffer", jni_s__direct_buffer, ARGS_REQ(1) | ARGS_OPT(1));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "string_benchmark", jni_s__string_benchmark, ARGS_REQ(2));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "string_cache", jni_s__string_cache, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "string_cache=", jni_s__set_string_cache, ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "string_cache_stats", jni_s__string_cache_stats, ARGS_NONE());
+#if MRUBY_JNI_STATS
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "stats", jni_s__stats, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "stats_enabled", jni_s__stats_enabled, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "stats_enabled=", jni_s__set_stats_enabled, ARGS_REQ(1));
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "reset_stats", jni_s__reset_stats, ARGS_NONE());
+  mrb_define_singleton_method(mrb, (struct RObject *)mod, "stats_dump", jni_s__stats_dump, ARGS_REQ(1));
+#endif
 
   klass = mrb_define_module_under(mrb, mod,
     "Definition");
@@ -823,45 +4772,209 @@ struct RClass *mrb_mruby_jni_init(mrb_state *mrb) {
   MRB_SET_INSTANCE_TT(klass, MRB_TT_DATA);
   mrb_define_method(mrb, klass, "initialize", jmeth__initialize, ARGS_REQ(3));
   mrb_define_method(mrb, klass, "types", jmeth__types, ARGS_REQ(0));
+  mrb_define_method(mrb, klass, "array_view=", jmeth__set_array_view, ARGS_REQ(1));
+  mrb_define_method(mrb, klass, "nonvirtual=", jmeth__set_nonvirtual, ARGS_REQ(1));
   mrb_define_method(mrb, klass, "check", jmeth__check, ARGS_REQ(1));
   mrb_define_method(mrb, klass, "call", jmeth__call, ARGS_REQ(3));
+  mrb_define_method(mrb, klass, "call_batch", jmeth__call_batch, ARGS_REQ(3));
+
+  klass = mrb_define_class_under(mrb, mod,
+    "Native", klass);
+  mrb_define_method(mrb, klass, "initialize", jnative__initialize, ARGS_REQ(4) | ARGS_OPT(2));
+
+  klass = mrb_define_class_under(mrb, mod,
+    "CallSite", mrb->object_class);
+  MRB_SET_INSTANCE_TT(klass, MRB_TT_DATA);
+  mrb_define_method(mrb, klass, "initialize", jsite__initialize, ARGS_REQ(1));
+  mrb_define_method(mrb, klass, "add", jsite__add, ARGS_REQ(1));
+  mrb_define_method(mrb, klass, "overloads", jsite__overloads, ARGS_NONE());
+  mrb_define_method(mrb, klass, "resolve", jsite__resolve, ARGS_REQ(1));
+  mrb_define_method(mrb, klass, "call", jsite__call, ARGS_REQ(3));
+  mrb_define_method(mrb, klass, "stats", jsite__stats, ARGS_NONE());
+
+  klass = mrb_define_class_under(mrb, mod,
+    "Field", mrb->object_class);
+  MRB_SET_INSTANCE_TT(klass, MRB_TT_DATA);
+  mrb_define_method(mrb, klass, "initialize", jfield__initialize, ARGS_REQ(3));
+  mrb_define_method(mrb, klass, "get", jfield__get, ARGS_OPT(1));
+  mrb_define_method(mrb, klass, "set", jfield__set, ARGS_REQ(2));
+  mrb_define_method(mrb, klass, "static?", jfield__static_p, ARGS_NONE());
 
   klass = mrb_define_class_under(mrb, mod,
     "Object", mrb->object_class);
   MRB_SET_INSTANCE_TT(klass, MRB_TT_DATA);
+  ((struct mrb_jni_context *)mrb->ud)->object_class = klass;
+
+  klass = mrb_define_class_under(mrb, mod,
+    "JavaException", E_RUNTIME_ERROR);
+  mrb_define_method(mrb, klass, "message", jexc__message, ARGS_NONE());
+  mrb_define_method(mrb, klass, "to_s", jexc__message, ARGS_NONE());
+  mrb_define_method(mrb, klass, "java_backtrace", jexc__java_backtrace, ARGS_NONE());
+  mrb_define_method(mrb, klass, "throwable", jexc__throwable, ARGS_NONE());
+  ((struct mrb_jni_context *)mrb->ud)->java_exception_class = klass;
+
+  klass = mrb_define_class_under(mrb, mod,
+    "Array", mrb->object_class);
+  MRB_SET_INSTANCE_TT(klass, MRB_TT_DATA);
+  mrb_include_module(mrb, klass, mrb_module_get(mrb, "Enumerable"));
+  mrb_define_method(mrb, klass, "size", jary__size, ARGS_NONE());
+  mrb_define_method(mrb, klass, "length", jary__size, ARGS_NONE());
+  mrb_define_method(mrb, klass, "[]", jary__aref, ARGS_REQ(1) | ARGS_OPT(1));
+  mrb_define_method(mrb, klass, "to_a", jary__to_a, ARGS_NONE());
+  mrb_define_method(mrb, klass, "each", jary__each, ARGS_NONE());
+  ((struct mrb_jni_context *)mrb->ud)->array_class = klass;
+
+  klass = mrb_define_class_under(mrb, mod,
+    "Buffer", mrb->object_class);
+  MRB_SET_INSTANCE_TT(klass, MRB_TT_DATA);
+  mrb_define_method(mrb, klass, "initialize", jbuf__initialize, ARGS_REQ(1));
+  mrb_define_method(mrb, klass, "size", jbuf__size, ARGS_NONE());
+  mrb_define_method(mrb, klass, "read", jbuf__read, ARGS_OPT(2));
+  mrb_define_method(mrb, klass, "to_s", jbuf__read, ARGS_NONE());
+  mrb_define_method(mrb, klass, "write", jbuf__write, ARGS_REQ(2));
+  mrb_define_method(mrb, klass, "byte_buffer", jbuf__byte_buffer, ARGS_OPT(1));
+
+  klass = mrb_define_class_under(mrb, mod,
+    "Long", mrb->object_class);
+  MRB_SET_INSTANCE_TT(klass, MRB_TT_DATA);
+  mrb_include_module(mrb, klass, mrb_module_get(mrb, "Comparable"));
+  mrb_define_method(mrb, klass, "initialize", jlong__initialize, ARGS_REQ(1) | ARGS_OPT(1));
+  mrb_define_method(mrb, klass, "to_s", jlong__to_s, ARGS_NONE());
+  mrb_define_method(mrb, klass, "inspect", jlong__to_s, ARGS_NONE());
+  mrb_define_method(mrb, klass, "to_f", jlong__to_f, ARGS_NONE());
+  mrb_define_method(mrb, klass, "hi", jlong__hi, ARGS_NONE());
+  mrb_define_method(mrb, klass, "lo", jlong__lo, ARGS_NONE());
+  mrb_define_method(mrb, klass, "<=>", jlong__cmp, ARGS_REQ(1));
+  mrb_define_method(mrb, klass, "==", jlong__eq, ARGS_REQ(1));
+  mrb_define_method(mrb, klass, "eql?", jlong__eq, ARGS_REQ(1));
+  mrb_define_method(mrb, klass, "hash", jlong__hash, ARGS_NONE());
+  ((struct mrb_jni_context *)mrb->ud)->long_class = klass;
+
+#ifdef MRUBY_JNI_BINDINGS
+  mrb_mruby_jni_bindings_init(mrb);
+#endif
 
   return mod;
 }
 
 int mrb_mruby_jni_check_exc(mrb_state *mrb) {
-  JNIEnv* env = (JNIEnv*)mrb->ud;
+  JNIEnv* env = jni_env(mrb);
 
   if (mrb->exc) {
-    mrb_value mstr;
-    mrb_value mexc;
-    mrb_value mback;
-    jclass jclazz;
     if ((*env)->ExceptionCheck(env)) {
       //(*env)->ExceptionClear(env);
       mrb->exc = 0;
       return 1;
     }
-    mexc =  mrb_obj_value(mrb->exc);
-    mstr = mrb_funcall(mrb, mexc, "message", 0);
-    mrb_funcall(mrb, mstr, "<<", 1, mrb_str_new(mrb, "\n", 1));
-    mback = mrb_funcall(mrb, mexc, "backtrace", 0);
-    mback = mrb_funcall(mrb, mback, "join", 1, mrb_str_new(mrb, "\n", 1));
-    mrb_funcall(mrb, mstr, "<<", 1, mback);
-    mrb->exc = 0;
-    jclazz = (*env)->FindClass(env, "java/lang/RuntimeException");
-    if (jclazz) {
-      (*env)->ThrowNew(env, jclazz, mrb_string_value_cstr(mrb, &mstr));
-      (*env)->DeleteLocalRef(env, jclazz);
-    }
+    jexc_throw_mexc(mrb);
     return 1;
   }
   return 0;
 }
 
+/* conversions for generated bindings (tools/jni_bindgen.rb) */
+mrb_value mrb_mruby_jni_jstr2mstr(mrb_state *mrb, jstring jstr) {
+  if (!jstr) {
+    return mrb_nil_value();
+  }
+  return jstr2mstr(mrb, jstr);
+}
+
+jstring mrb_mruby_jni_mstr2jstr(mrb_state *mrb, mrb_value mstr) {
+  if (mrb_nil_p(mstr)) {
+    return NULL;
+  }
+  if (mrb_type(mstr) != MRB_TT_STRING) {
+    mrb_raisef(mrb, E_TYPE_ERROR, "Jni: expected String, got %S", mstr);
+  }
+  return mstr2jstr(mrb, mstr);
+}
+
+mrb_value mrb_mruby_jni_jlong2mlong(mrb_state *mrb, jlong jl) {
+  return jlong2mlong(mrb, jl);
+}
+
+jlong mrb_mruby_jni_mlong2jlong(mrb_state *mrb, mrb_value mobj) {
+  jlong jl;
+
+  if (!mlong2jlong(mrb, mobj, &jl)) {
+    mrb_raisef(mrb, E_TYPE_ERROR, "Jni: expected Fixnum or Jni::Long, got %S", mobj);
+  }
+  return jl;
+}
+
+jobject mrb_mruby_jni_jobject(mrb_state *mrb, mrb_value mobj) {
+  if (mrb_nil_p(mobj)) {
+    return NULL;
+  }
+  if (!jobj_data_p(mobj) || !DATA_PTR(mobj)) {
+    mrb_raisef(mrb, E_TYPE_ERROR, "Jni: no Java object behind %S", mobj);
+  }
+  return (jobject)DATA_PTR(mobj);
+}
+
+/* wraps jobj in the class name2class on mrecv maps its runtime class to, else Jni::Object */
+mrb_value mrb_mruby_jni_jobj2mobj(mrb_state *mrb, mrb_value mrecv, jobject jobj) {
+  JNIEnv* env = jni_env(mrb);
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+  mrb_value mclass;
+
+  if (!jobj) {
+    return mrb_nil_value();
+  }
+  mclass = mrb_mruby_jni_jclass2mclass(mrb, (*env)->GetObjectClass(env, jobj), mrecv);
+  while (mrb_type(mclass) == MRB_TT_ARRAY) {
+    mclass = mrb_ary_ref(mrb, mclass, 0);
+  }
+  if (mrb_type(mclass) != MRB_TT_CLASS) {
+    return mrb_mruby_jni_wrap_jobject(mrb, ctx->object_class, jobj);
+  }
+  return mrb_mruby_jni_wrap_jobject(mrb, mrb_class_ptr(mclass), jobj);
+}
+
+void mrb_mruby_jni_raise_jexc(mrb_state *mrb, const char *mname) {
+  mrb_exc_raise(mrb, jexc_take(mrb, mrb_str_new_cstr(mrb, mname)));
+}
+
 void mrb_mruby_jni_gem_init(mrb_state* mrb) {}
-void mrb_mruby_jni_gem_final(mrb_state* mrb) {}
+void mrb_mruby_jni_gem_final(mrb_state* mrb) {
+  struct mrb_jni_context *ctx = (struct mrb_jni_context *)mrb->ud;
+
+  jnative_detach_all(mrb);
+  /* before init_vm, or if it failed, mrb->ud belongs to the embedder */
+  if (ctx && ctx->magic == JNI_CONTEXT_MAGIC) {
+    /* the key exists once a context does */
+    if (pthread_getspecific(jni_state_key) == mrb) {
+      pthread_setspecific(jni_state_key, NULL);
+    }
+    if (ctx->manifest) {
+      jmanifest_free(mrb, ctx->manifest);
+    }
+#if MRUBY_JNI_STATS
+    {
+      /* methods are swept after this; leave them unlinking from themselves */
+      struct jmeth_stats *stats, *next;
+
+      for (stats = ctx->stats_list.next; stats != &ctx->stats_list; stats = next) {
+        next = stats->next;
+        stats->prev = stats->next = stats;
+      }
+    }
+#endif
+    jclass_cache_clear(mrb);
+    jexc_clear(mrb);
+    jstr_cache_clear(mrb);
+    jni_flush_refs(mrb);
+    if (ctx->system_class) {
+      JNIEnv* env = jni_env(mrb);
+
+      (*env)->DeleteGlobalRef(env, ctx->system_class);
+    }
+    jidmap_clear(ctx);
+    free(ctx->jref_table);
+    free(ctx->release_queue);
+    ctx->magic = 0;
+    free(ctx);
+    mrb->ud = NULL;
+  }
+}
@@ -0,0 +1,47 @@
+public class JniTestFixture {
+  public static int counter;
+
+  public int count;
+  public long big;
+  public String name;
+
+  public static native int add(int a, int b);
+  public native String greet(String name);
+  public static native int fail();
+  public static native String wrongType();
+  public static native void flag(boolean b);
+
+  public static int callAdd(int a, int b) {
+    return add(a, b);
+  }
+
+  public static String callCatching(boolean wrong) {
+    try {
+      if (wrong) {
+        wrongType();
+      } else {
+        fail();
+      }
+      return "none";
+    } catch (RuntimeException e) {
+      return e.getClass().getName() + ": " + e.getMessage();
+    }
+  }
+
+  public static String callOnThread() throws InterruptedException {
+    final String[] out = new String[1];
+    Thread t = new Thread(new Runnable() {
+      public void run() {
+        try {
+          add(1, 2);
+          out[0] = "none";
+        } catch (RuntimeException e) {
+          out[0] = e.getClass().getName();
+        }
+      }
+    });
+    t.start();
+    t.join();
+    return out[0];
+  }
+}
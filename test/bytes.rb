@@ -0,0 +1,57 @@
+if Object.const_defined?(:JniTest)
+  T = JniTest::T
+
+  def copy_of(bytes, len)
+    @copy_of ||= JniTest.jmethod(JniTest::JArrays, [T::Byte], 'copyOf', [[T::Byte], T::Int], true)
+    @copy_of.call(JniTest::JArrays, 'copyOf', [bytes, len])
+  end
+
+  def bb_get(bb, i)
+    @bb_get ||= JniTest.jmethod(JniTest::JByteBuffer, T::Byte, 'get', [T::Int])
+    @bb_get.call(bb, 'get', [i])
+  end
+
+  def bb_put(bb, i, b)
+    @bb_put ||= JniTest.jmethod(JniTest::JByteBuffer, JniTest::JByteBuffer, 'put', [T::Int, T::Byte])
+    @bb_put.call(bb, 'put', [i, b])
+  end
+
+  def bb_capacity(bb)
+    @bb_capacity ||= JniTest.jmethod(JniTest::JByteBuffer, T::Int, 'capacity')
+    @bb_capacity.call(bb, 'capacity', [])
+  end
+
+  assert('byte[] round trip keeps NUL and high bytes') do
+    bytes = "a\0b\xff\0"
+    assert_equal bytes, copy_of(bytes, 5)
+    assert_equal "a\0", copy_of(bytes, 2)
+    assert_equal "a\0b\xff\0\0", copy_of(bytes, 6)
+    assert_equal '', copy_of('', 0)
+  end
+
+  assert('Jni.direct_buffer copies the String') do
+    str = "ab\0c"
+    bb = Jni.direct_buffer(str, JniTest::JByteBuffer)
+    assert_equal 4, bb_capacity(bb)
+    assert_equal 98, bb_get(bb, 1)
+    assert_equal 0, bb_get(bb, 2)
+    bb_put(bb, 0, 120)
+    assert_equal 120, bb_get(bb, 0)
+    assert_equal "ab\0c", str
+    str << 'longer'
+    assert_equal 4, bb_capacity(bb)
+  end
+
+  assert('Jni::Buffer#byte_buffer shares memory with Java') do
+    buf = Jni::Buffer.new(4)
+    assert_equal 4, buf.size
+    assert_equal "\0\0\0\0", buf.to_s
+    buf.write(0, 'hi')
+    bb = buf.byte_buffer(JniTest::JByteBuffer)
+    assert_equal 105, bb_get(bb, 1)
+    bb_put(bb, 2, 33)
+    assert_equal 'hi!', buf.read(0, 3)
+    assert_raise(IndexError) { buf.write(3, 'xy') }
+    assert_raise(IndexError) { buf.read(2, 3) }
+  end
+end
@@ -0,0 +1,29 @@
+if Object.const_defined?(:JniTest)
+  T = JniTest::T
+
+  assert('Jni::Method#call_batch with a shared receiver') do
+    max = JniTest.jmethod(JniTest::JMath, T::Int, 'max', [T::Int, T::Int], true)
+    assert_equal [2, 5, -1], max.call_batch(JniTest::JMath, 'max', [[1, 2], [5, 3], [-1, -7]])
+    assert_equal [], max.call_batch(JniTest::JMath, 'max', [])
+  end
+
+  assert('Jni::Method#call_batch with one receiver per call') do
+    int_value = JniTest.jmethod(JniTest::JInteger, T::Int, 'intValue')
+    ints = [1, 2, 3].map { |i| JniTest.integer(i) }
+    assert_equal [1, 2, 3], int_value.call_batch(ints, 'intValue', nil)
+    seen = []
+    assert_equal ints, int_value.call_batch(ints, 'intValue', nil) { |r| seen << r }
+    assert_equal [1, 2, 3], seen
+  end
+
+  assert('Jni::Method#call_batch checks every call before running any') do
+    max = JniTest.jmethod(JniTest::JMath, T::Int, 'max', [T::Int, T::Int], true)
+    seen = []
+    assert_raise(TypeError) do
+      max.call_batch(JniTest::JMath, 'max', [[1, 2], ['a', 3]]) { |r| seen << r }
+    end
+    assert_equal [], seen
+    int_value = JniTest.jmethod(JniTest::JInteger, T::Int, 'intValue')
+    assert_raise(ArgumentError) { int_value.call_batch([JniTest.integer(1)], 'intValue', [[], []]) }
+  end
+end
@@ -0,0 +1,50 @@
+if Object.const_defined?(:JniTest)
+  T = JniTest::T
+
+  def max_site
+    Jni::CallSite.new([[T::Int, T::Int], [T::Long, T::Long], [T::Double, T::Double]].map do |args|
+      JniTest.jmethod(JniTest::JMath, args[0], 'max', args, true)
+    end)
+  end
+
+  assert('Jni::CallSite resolves overloads by argument class') do
+    site = max_site
+    assert_equal 2, site.call(JniTest::JMath, 'max', [1, 2])
+    assert_equal 2.5, site.call(JniTest::JMath, 'max', [1.5, 2.5])
+    assert_nil site.resolve(['a', 'b'])
+  end
+
+  assert('Jni::CallSite caches one entry per argument classes') do
+    site = max_site
+    site.call(JniTest::JMath, 'max', [1, 2])
+    site.call(JniTest::JMath, 'max', [3, 4])
+    site.call(JniTest::JMath, 'max', [1.5, 2.5])
+    site.call(JniTest::JMath, 'max', [3.5, 4.5])
+    stats = site.stats
+    assert_equal 2, stats[:hits]
+    assert_equal 2, stats[:misses]
+    assert_equal 2, stats[:entries]
+  end
+
+  assert('Jni::CallSite does not cache calls with nil') do
+    string_of = JniTest.jmethod(JniTest::JString, T::Str, 'valueOf', [Jni::Object], true)
+    site = Jni::CallSite.new([string_of])
+    assert_equal 'null', site.call(JniTest::JString, 'valueOf', [nil])
+    assert_equal 'null', site.call(JniTest::JString, 'valueOf', [nil])
+    assert_equal 0, site.stats[:entries]
+  end
+
+  assert('Jni::CallSite does not cache unbound wrappers') do
+    append_cs = JniTest.jmethod(JniTest::JStringBuilder, JniTest::JStringBuilder, 'append', ['Ljava/lang/CharSequence;'])
+    append_obj = JniTest.jmethod(JniTest::JStringBuilder, JniTest::JStringBuilder, 'append', [Jni::Object])
+    site = Jni::CallSite.new([append_cs, append_obj])
+    int = JniTest.generic(JniTest.integer(1000))
+    sb = JniTest.generic(JniTest.string_builder('x'))
+    assert_equal Jni::Object, int.class
+    assert_equal Jni::Object, sb.class
+    assert_equal append_obj, site.resolve([int])
+    assert_equal append_cs, site.resolve([sb])
+    assert_equal append_obj, site.resolve([int])
+    assert_equal 0, site.stats[:entries]
+  end
+end
@@ -0,0 +1,60 @@
+if Object.const_defined?(:JniTest)
+  T = JniTest::T
+
+  class JniTestArgumentError < Jni::JavaException; end
+
+  def parse_int(str)
+    @parse_int ||= JniTest.jmethod(JniTest::JInteger, T::Int, 'parseInt', [T::Str], true)
+    @parse_int.call(JniTest::JInteger, 'parseInt', [str])
+  end
+
+  def prefix?(str, prefix)
+    str[0, prefix.size] == prefix
+  end
+
+  def java_error
+    parse_int('x')
+    nil
+  rescue Jni::JavaException => e
+    e
+  end
+
+  assert('Jni::JavaException carries the throwable') do
+    e = java_error
+    assert_equal Jni::JavaException, e.class
+    assert_equal Jni::Object, e.throwable.class
+    assert_true prefix?(JniTest.string_of(e.throwable), 'java.lang.NumberFormatException')
+    assert_equal 42, parse_int('42')
+  end
+
+  assert('Jni::JavaException builds its message once') do
+    e = java_error
+    assert_true prefix?(e.message, "exception in java method 'parseInt': java.lang.NumberFormatException")
+    assert_true e.message.equal?(e.message)
+    assert_equal e.message, e.to_s
+  end
+
+  assert('Jni::JavaException#java_backtrace') do
+    back = java_error.java_backtrace
+    assert_equal Array, back.class
+    assert_true back.size > 0
+    assert_true back.any? { |frame| prefix?(frame, 'java.lang.Integer.parseInt') }
+  end
+
+  assert('Jni.map_exception') do
+    Jni.map_exception('java.lang.IllegalArgumentException', JniTestArgumentError)
+    e = java_error
+    assert_equal JniTestArgumentError, e.class
+    assert_true prefix?(JniTest.string_of(e.throwable), 'java.lang.NumberFormatException')
+  end
+end
+
+if Object.const_defined?(:JniTest) && JniTest.const_defined?(:Fixture)
+  F = JniTest::Fixture
+
+  assert('Jni::JavaException rethrows the original throwable into Java') do
+    Jni::Native.new(JniTest.static(F), T::Int, 'fail', []) { |klass| parse_int('x') }
+    catching = JniTest.jmethod(F, T::Str, 'callCatching', [T::Bool], true)
+    assert_true prefix?(catching.call(F, 'callCatching', [false]), 'java.lang.NumberFormatException: ')
+  end
+end
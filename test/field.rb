@@ -0,0 +1,46 @@
+if Object.const_defined?(:JniTest)
+  T = JniTest::T
+
+  assert('Jni::Field reads a static field') do
+    max = Jni::Field.new(JniTest.static(JniTest::JInteger), T::Int, 'MAX_VALUE')
+    assert_true max.static?
+    assert_equal 2147483647, max.get
+  end
+
+  assert('Jni::Field raises NameError for a missing field') do
+    assert_raise(NameError) { Jni::Field.new(JniTest::JInteger, T::Int, 'no_such_field') }
+  end
+end
+
+if Object.const_defined?(:JniTest) && JniTest.const_defined?(:Fixture)
+  assert('Jni::Field gets and sets instance fields') do
+    obj = JniTest.fixture
+    count = Jni::Field.new(JniTest::Fixture, T::Int, 'count')
+    assert_false count.static?
+    assert_equal 0, count.get(obj)
+    count.set(obj, 42)
+    assert_equal 42, count.get(obj)
+    assert_raise(TypeError) { count.set(obj, 'x') }
+    assert_raise(RuntimeError) { count.get(nil) }
+  end
+
+  assert('Jni::Field with String and long fields') do
+    obj = JniTest.fixture
+    name = Jni::Field.new(JniTest::Fixture, T::Str, 'name')
+    assert_nil name.get(obj)
+    name.set(obj, "héllo")
+    assert_equal "héllo", name.get(obj)
+    name.set(obj, nil)
+    assert_nil name.get(obj)
+
+    big = Jni::Field.new(JniTest::Fixture, T::Long, 'big')
+    big.set(obj, Jni::Long.new('9223372036854775807'))
+    assert_equal '9223372036854775807', big.get(obj).to_s
+  end
+
+  assert('Jni::Field sets a static field') do
+    counter = Jni::Field.new(JniTest.static(JniTest::Fixture), T::Int, 'counter')
+    counter.set(nil, 7)
+    assert_equal 7, counter.get
+  end
+end
@@ -0,0 +1,23 @@
+if Object.const_defined?(:JniTest)
+  assert('Jni.identity_map shares wrappers') do
+    Jni.identity_map = true
+    a = JniTest.integer(100)
+    hits = Jni.identity_map_stats[:hits]
+    b = JniTest.integer(100)
+    assert_true a.equal?(b)
+    assert_equal hits + 1, Jni.identity_map_stats[:hits]
+    Jni.identity_map = false
+  end
+
+  assert('Jni.identity_map forgets collected wrappers') do
+    Jni.identity_map = true
+    GC.start
+    size = Jni.identity_map_stats[:size]
+    10.times { |i| JniTest.integer(100000 + i) }
+    assert_true Jni.identity_map_stats[:size] >= size + 10
+    GC.start
+    assert_true Jni.identity_map_stats[:size] < size + 10
+    Jni.identity_map = false
+    assert_equal 0, Jni.identity_map_stats[:size]
+  end
+end
@@ -0,0 +1,115 @@
+#include <jni.h>
+#include <dlfcn.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mruby.h"
+#include "mruby/compile.h"
+#include "mruby/variable.h"
+#include "mruby-jni.h"
+
+/*
+ * Every test file runs in its own mrb_state; they share one JVM, loaded
+ * from JAVA_HOME at run time so mrbtest doesn't link libjvm.  Without a
+ * JDK JniTest stays undefined and the tests skip themselves; tests that
+ * need JniTestFixture also check JniTest::Fixture.
+ */
+typedef jint (JNICALL *jvm_create_t)(JavaVM **, void **, void *);
+
+static JavaVM *test_vm;
+static int test_vm_tried;
+
+static void *test_libjvm(void) {
+  static const char *patterns[] = {
+    "%s/lib/server/libjvm.*", "%s/jre/lib/server/libjvm.*", "%s/jre/lib/*/server/libjvm.*",
+  };
+  const char *home = getenv("JAVA_HOME");
+  char path[1024];
+  void *lib = NULL;
+  size_t i, j;
+
+  if (!home) {
+    return NULL;
+  }
+  for (i = 0; !lib && i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+    glob_t found;
+
+    snprintf(path, sizeof(path), patterns[i], home);
+    if (glob(path, 0, NULL, &found) != 0) {
+      continue;
+    }
+    for (j = 0; !lib && j < found.gl_pathc; j++) {
+      lib = dlopen(found.gl_pathv[j], RTLD_NOW | RTLD_GLOBAL);
+    }
+    globfree(&found);
+  }
+  return lib;
+}
+
+static JavaVM *test_jvm(void) {
+  JavaVMInitArgs vm_args;
+#ifdef MRUBY_JNI_TEST_CLASSPATH
+  JavaVMOption option;
+#endif
+  jvm_create_t create;
+  JNIEnv *env;
+  void *lib;
+
+  if (test_vm_tried) {
+    return test_vm;
+  }
+  test_vm_tried = 1;
+  lib = test_libjvm();
+  if (!lib) {
+    return NULL;
+  }
+  create = (jvm_create_t)dlsym(lib, "JNI_CreateJavaVM");
+  vm_args.version = JNI_VERSION_1_6;
+#ifdef MRUBY_JNI_TEST_CLASSPATH
+  option.optionString = (char *)"-Djava.class.path=" MRUBY_JNI_TEST_CLASSPATH;
+  vm_args.nOptions = 1;
+  vm_args.options = &option;
+#else
+  vm_args.nOptions = 0;
+  vm_args.options = NULL;
+#endif
+  vm_args.ignoreUnrecognized = JNI_TRUE;
+  if (!create || create(&test_vm, (void **)&env, &vm_args) != JNI_OK) {
+    test_vm = NULL;
+  }
+  return test_vm;
+}
+
+static void test_load(mrb_state *mrb, const char *name) {
+  const char *file = __FILE__;
+  const char *slash = strrchr(file, '/');
+  char path[1024];
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "%.*s%s", slash ? (int)(slash - file + 1) : 0, file, name);
+  fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "mruby-jni test: can't open %s\n", path);
+    return;
+  }
+  mrb_load_file(mrb, fp);
+  fclose(fp);
+  if (mrb->exc) {
+    mrb_print_error(mrb);
+    mrb->exc = NULL;
+  }
+}
+
+void mrb_mruby_jni_gem_test(mrb_state *mrb) {
+  JavaVM *vm = test_jvm();
+
+  if (vm && mrb_mruby_jni_init_vm(mrb, vm)) {
+#ifdef MRUBY_JNI_TEST_CLASSPATH
+    /* JniTestFixture, compiled by mrbgem.rake */
+    mrb_gv_set(mrb, mrb_intern_cstr(mrb, "$jni_test_fixture"), mrb_true_value());
+#endif
+    test_load(mrb, "support/mapping.rb");
+  }
+}
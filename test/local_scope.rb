@@ -0,0 +1,30 @@
+if Object.const_defined?(:JniTest)
+  assert('Jni.local_scope keeps its result') do
+    int = Jni.local_scope { JniTest.integer(1000) }
+    assert_equal 1000, JniTest.int_value(int)
+  end
+
+  assert('Jni.local_scope keeps the elements of an Array result') do
+    ints = Jni.local_scope { [JniTest.integer(1), JniTest.integer(2)] }
+    assert_equal [1, 2], ints.map { |i| JniTest.int_value(i) }
+  end
+
+  assert('Jni.local_scope detaches wrappers it does not return') do
+    kept = nil
+    Jni.local_scope do
+      kept = JniTest.integer(1000)
+      nil
+    end
+    assert_raise(RuntimeError) { JniTest.int_value(kept) }
+    assert_raise(RuntimeError) { JniTest.string_of(kept) }
+  end
+
+  assert('Jni.promote') do
+    kept = nil
+    Jni.local_scope do
+      kept = Jni.promote(JniTest.integer(1000))
+      nil
+    end
+    assert_equal 1000, JniTest.int_value(kept)
+  end
+end
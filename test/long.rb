@@ -0,0 +1,51 @@
+if Object.const_defined?(:JniTest)
+  T = JniTest::T
+
+  def parse_long(str)
+    @parse_long ||= JniTest.jmethod(JniTest::JLong, T::Long, 'parseLong', [T::Str], true)
+    @parse_long.call(JniTest::JLong, 'parseLong', [str])
+  end
+
+  def long_to_s(l)
+    @long_to_s ||= JniTest.jmethod(JniTest::JLong, T::Str, 'toString', [T::Long], true)
+    @long_to_s.call(JniTest::JLong, 'toString', [l])
+  end
+
+  assert('Jni::Long.new') do
+    assert_equal '9223372036854775807', Jni::Long.new('9223372036854775807').to_s
+    assert_equal '-9223372036854775808', Jni::Long.new('-9223372036854775808').to_s
+    assert_equal '4294967296', Jni::Long.new(1, 0).to_s
+    assert_raise(ArgumentError) { Jni::Long.new('12x') }
+    assert_raise(TypeError) { Jni::Long.new(1.5) }
+  end
+
+  assert('Jni::Long#hi and #lo') do
+    l = Jni::Long.new(-1)
+    assert_equal(-1, l.hi)
+    assert_equal(-1, l.lo)
+    l = Jni::Long.new(1, 2)
+    assert_equal 1, l.hi
+    assert_equal 2, l.lo
+  end
+
+  assert('Jni::Long from Java') do
+    l = parse_long('9223372036854775807')
+    assert_equal Jni::Long, l.class
+    assert_true l == Jni::Long.new('9223372036854775807')
+    assert_equal 42, parse_long('42')
+  end
+
+  assert('Jni::Long to Java') do
+    assert_equal '-9223372036854775808', long_to_s(Jni::Long.new('-9223372036854775808'))
+    assert_equal '4294967296', long_to_s(Jni::Long.new(1, 0))
+    assert_equal '7', long_to_s(7)
+  end
+
+  assert('Jni::Long comparison') do
+    big = Jni::Long.new('9223372036854775807')
+    assert_equal 1, big <=> 0
+    assert_equal 0, big <=> Jni::Long.new('9223372036854775807')
+    assert_true big.eql?(Jni::Long.new('9223372036854775807'))
+    assert_equal big.hash, Jni::Long.new('9223372036854775807').hash
+  end
+end
@@ -0,0 +1,43 @@
+if Object.const_defined?(:JniTest)
+  T = JniTest::T
+  MANIFEST = "/tmp/mruby-jni-test-#{object_id}.manifest"
+
+  class JniTestSystem < Jni::Object; end
+  class JniTestSystem2 < Jni::Object; end
+
+  def identity_hash
+    JniTest.jmethod(JniTestSystem, T::Int, 'identityHashCode', [Jni::Object], true)
+  end
+
+  assert('Jni.save_manifest records classes and methods') do
+    assert_raise(RuntimeError) { Jni.save_manifest(MANIFEST) }
+    Jni.manifest_record = true
+    JniTest.bind JniTestSystem, 'java/lang/System'
+    identity_hash
+    Jni.manifest_record = false
+    assert_true Jni.save_manifest(MANIFEST) > 0
+  end
+
+  assert('Jni.warmup reports a missing manifest') do
+    assert_raise(RuntimeError) { Jni.warmup('/nonexistent/mruby-jni.manifest') }
+  end
+
+  assert('Jni.warmup resolves the manifest up front') do
+    assert_nil Jni.warmup_stats
+    Jni.warmup(MANIFEST)
+    stats = Jni.warmup_stats
+    assert_true stats[:classes] >= 1
+    assert_true stats[:methods] >= 1
+    assert_equal stats[:classes] + stats[:methods], stats[:resolved]
+    assert_raise(RuntimeError) { Jni.warmup(MANIFEST) }
+  end
+
+  assert('definitions matching the manifest skip resolution') do
+    hits = Jni.warmup_stats[:hits]
+    JniTest.bind JniTestSystem2, 'java/lang/System'
+    meth = identity_hash
+    assert_true Jni.warmup_stats[:hits] >= hits + 2
+    int = JniTest.integer(1)
+    assert_equal meth.call(JniTestSystem, 'identityHashCode', [int]), meth.call(JniTestSystem, 'identityHashCode', [int])
+  end
+end
@@ -0,0 +1,50 @@
+if Object.const_defined?(:JniTest) && JniTest.const_defined?(:Fixture)
+  T = JniTest::T
+  F = JniTest::Fixture
+
+  def fixture_call(ret, name, args, margs)
+    JniTest.jmethod(F, ret, name, args, true).call(F, name, margs)
+  end
+
+  def prefix?(str, prefix)
+    str[0, prefix.size] == prefix
+  end
+
+  assert('Jni::Native dispatches Java calls to the handler') do
+    seen = nil
+    Jni::Native.new(JniTest.static(F), T::Int, 'add', [T::Int, T::Int]) do |klass, a, b|
+      seen = klass
+      a + b
+    end
+    assert_equal 5, fixture_call(T::Int, 'callAdd', [T::Int, T::Int], [2, 3])
+    assert_equal(-1, fixture_call(T::Int, 'callAdd', [T::Int, T::Int], [2, -3]))
+    assert_equal F, seen
+  end
+
+  assert('Jni::Native instance method with a String') do
+    handler = Object.new
+    def handler.greet(obj, name)
+      "hello #{name} from #{obj.class}"
+    end
+    Jni::Native.new(F, T::Str, 'greet', [T::Str], handler, :greet)
+    greet = JniTest.jmethod(F, T::Str, 'greet', [T::Str])
+    assert_equal "hello wörld from #{F}", greet.call(JniTest.fixture, 'greet', ["wörld"])
+  end
+
+  assert('Jni::Native handler errors become Java exceptions') do
+    Jni::Native.new(JniTest.static(F), T::Int, 'fail', []) { |klass| raise 'boom' }
+    Jni::Native.new(JniTest.static(F), T::Str, 'wrongType', []) { |klass| 42 }
+    assert_true prefix?(fixture_call(T::Str, 'callCatching', [T::Bool], [false]), 'java.lang.RuntimeException: boom')
+    assert_true prefix?(fixture_call(T::Str, 'callCatching', [T::Bool], [true]), 'java.lang.ClassCastException: ')
+  end
+
+  assert('Jni::Native refuses calls from a thread that does not own the state') do
+    assert_equal 'java.lang.IllegalStateException', fixture_call(T::Str, 'callOnThread', [], [])
+  end
+
+  assert('Jni::Native rejects parameters without a trampoline') do
+    assert_raise(RuntimeError) do
+      Jni::Native.new(JniTest.static(F), T::Void, 'flag', [T::Bool]) { |klass, b| nil }
+    end
+  end
+end
@@ -0,0 +1,36 @@
+if Object.const_defined?(:JniTest)
+  T = JniTest::T
+
+  assert('Jni.ref_stats counts wrappers') do
+    JniTest.integer(0)
+    Jni.track_refs = true
+    ints = (1..5).map { |i| JniTest.integer(i) }
+    assert_equal 5, Jni.ref_stats[:by_origin][:wrap]
+    assert_equal 5, ints.size
+    Jni.track_refs = false
+  end
+
+  assert('Jni.ref_stats counts array views') do
+    to_chars = JniTest.jmethod(JniTest::JCharacter, [T::Char], 'toChars', [T::Int], true)
+    to_chars.array_view = true
+    Jni.track_refs = true
+    chars = to_chars.call(JniTest::JCharacter, 'toChars', [65])
+    assert_equal 1, chars.size
+    assert_equal 65, chars[0]
+    assert_equal 1, Jni.ref_stats[:by_origin][:array]
+    Jni.track_refs = false
+  end
+
+  assert('Jni.ref_soft_limit collects at the next call') do
+    JniTest.integer(0)
+    GC.start
+    JniTest.integer(0)
+    stats = Jni.ref_stats
+    Jni.ref_soft_limit = stats[:live] + 1
+    JniTest.integer(1)
+    assert_equal stats[:gc_runs], Jni.ref_stats[:gc_runs]
+    JniTest.integer(2)
+    assert_equal stats[:gc_runs] + 1, Jni.ref_stats[:gc_runs]
+    Jni.ref_soft_limit = 0
+  end
+end
@@ -0,0 +1,54 @@
+if Object.const_defined?(:JniTest) && Jni.respond_to?(:stats)
+  T = JniTest::T
+  MAX = 'java/lang/Math.max(II)I'
+  PARSE_INT = 'java/lang/Integer.parseInt(Ljava/lang/String;)I'
+
+  def max(a, b)
+    @max ||= JniTest.jmethod(JniTest::JMath, T::Int, 'max', [T::Int, T::Int], true)
+    @max.call(JniTest::JMath, 'max', [a, b])
+  end
+
+  def parse_int(str)
+    @parse_int ||= JniTest.jmethod(JniTest::JInteger, T::Int, 'parseInt', [T::Str], true)
+    @parse_int.call(JniTest::JInteger, 'parseInt', [str])
+  end
+
+  assert('Jni.stats is off by default') do
+    assert_false Jni.stats_enabled
+    max(1, 2)
+    assert_equal({}, Jni.stats)
+  end
+
+  assert('Jni.stats counts calls per method') do
+    Jni.stats_enabled = true
+    3.times { |i| max(i, 1) }
+    parse_int('7')
+    stats = Jni.stats
+    assert_equal 3, stats[MAX][:calls]
+    assert_equal 0, stats[MAX][:check_misses]
+    assert_equal 1, stats[PARSE_INT][:calls]
+    assert_equal 1, stats[PARSE_INT][:strings]
+    assert_true stats[MAX][:transitions] >= 6
+    assert_true stats[MAX][:java_ns] >= 0
+    assert_false max('a', 1)
+    assert_equal 1, Jni.stats[MAX][:check_misses]
+    Jni.reset_stats
+    assert_equal({}, Jni.stats)
+    Jni.stats_enabled = false
+  end
+
+  assert('Jni.stats_dump yields every n calls') do
+    Jni.stats_enabled = true
+    dumps = []
+    Jni.stats_dump(2) { |stats| dumps << stats }
+    4.times { max(1, 2) }
+    assert_equal 2, dumps.size
+    assert_equal 4, dumps.last[MAX][:calls]
+    Jni.stats_dump(0)
+    max(1, 2)
+    assert_equal 2, dumps.size
+    assert_raise(ArgumentError) { Jni.stats_dump(-1) }
+    Jni.stats_enabled = false
+    Jni.reset_stats
+  end
+end
@@ -0,0 +1,30 @@
+if Object.const_defined?(:JniTest)
+  T = JniTest::T
+
+  def sb_to_s(sb)
+    @sb_to_s ||= JniTest.jmethod(JniTest::JStringBuilder, T::Str, 'toString')
+    @sb_to_s.call(sb, 'toString', [])
+  end
+
+  def sb_length(sb)
+    @sb_length ||= JniTest.jmethod(JniTest::JStringBuilder, T::Int, 'length')
+    @sb_length.call(sb, 'length', [])
+  end
+
+  assert('String round trip through UTF-16') do
+    ['', 'hello', "héllo", "あい", "héllo 😀"].each do |str|
+      assert_equal str, sb_to_s(JniTest.string_builder(str))
+    end
+  end
+
+  assert('String becomes UTF-16 code units') do
+    assert_equal 5, sb_length(JniTest.string_builder('hello'))
+    assert_equal 5, sb_length(JniTest.string_builder("héllo"))
+    # the emoji is a surrogate pair
+    assert_equal 8, sb_length(JniTest.string_builder("héllo 😀"))
+  end
+
+  assert('String nil argument') do
+    assert_equal 'null', JniTest.string_of(nil)
+  end
+end
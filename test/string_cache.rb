@@ -0,0 +1,43 @@
+if Object.const_defined?(:JniTest)
+  T = JniTest::T
+
+  def parse_int(str)
+    @parse_int ||= JniTest.jmethod(JniTest::JInteger, T::Int, 'parseInt', [T::Str], true)
+    @parse_int.call(JniTest::JInteger, 'parseInt', [str])
+  end
+
+  assert('Jni.string_cache reuses Java Strings') do
+    assert_equal 4, (Jni.string_cache = 4)
+    assert_equal 4, Jni.string_cache
+    assert_equal 42, parse_int('42')
+    assert_equal 42, parse_int('42')
+    stats = Jni.string_cache_stats
+    assert_equal 1, stats[:hits]
+    assert_equal 1, stats[:misses]
+    assert_equal 1, stats[:size]
+    Jni.string_cache = 0
+  end
+
+  assert('Jni.string_cache evicts the least recently used String') do
+    Jni.string_cache = 4
+    %w(1 2 3 4).each { |s| parse_int(s) }
+    parse_int('1')
+    assert_equal 5, parse_int('5')
+    stats = Jni.string_cache_stats
+    assert_equal 1, stats[:evictions]
+    assert_equal 4, stats[:size]
+    # '2' was the oldest, '1' survived
+    hits = stats[:hits]
+    assert_equal 1, parse_int('1')
+    assert_equal hits + 1, Jni.string_cache_stats[:hits]
+    Jni.string_cache = 0
+  end
+
+  assert('Jni.string_cache skips long Strings') do
+    Jni.string_cache = 4
+    assert_equal 42, parse_int('0' * 70 + '42')
+    assert_equal 0, Jni.string_cache_stats[:size]
+    Jni.string_cache = 0
+    assert_equal 0, Jni.string_cache_stats[:capacity]
+  end
+end
@@ -0,0 +1,144 @@
+# Minimal name/signature mapping for the tests, loaded by test/jvm.c once
+# the JVM is up.  The gem leaves this layer to the embedding application.
+
+module Jni
+  class Generics; end
+end
+
+module JniTest
+  module T
+    class Void; end
+    class Bool; end
+    class Byte; end
+    class Char; end
+    class Int; end
+    class Long; end
+    class Double; end
+    class Str; end
+  end
+
+  TYPES = {
+    T::Void => 'V', T::Bool => 'Z', T::Byte => 'B', T::Char => 'C', T::Int => 'I', T::Long => 'J',
+    T::Double => 'D', T::Str => 's',
+  }
+  PATHS = {}
+
+  module Mapping
+    def get_type(args)
+      args.map { |t| JniTest.type(t) }.join
+    end
+
+    def class2type(ret)
+      TYPES[ret] || 'L'
+    end
+
+    def class2sig(t)
+      JniTest.sig(t)
+    end
+  end
+
+  def self.bind(klass, path)
+    klass.extend Jni::Definition
+    klass.extend Mapping
+    klass.class_path = path
+    PATHS[klass] = path
+    klass
+  end
+
+  # types are marker classes, bound classes, [type] or raw "Lpath;"
+  # descriptors; Jni::Object stands for java.lang.Object
+  def self.type(t)
+    return t if t.is_a?(String)
+    return "[#{type(t[0])}" if t.is_a?(Array)
+    TYPES[t] || "L#{PATHS[t] || 'java/lang/Object'};"
+  end
+
+  def self.sig(t)
+    s = type(t)
+    s[-1] == 's' ? "#{s[0...-1]}Ljava/lang/String;" : s
+  end
+
+  def self.jmethod(klass, ret, name, args = [], static = false)
+    Jni::Method.new(static ? self.static(klass) : klass, ret, name, args)
+  end
+
+  class JInteger < Jni::Object; end
+  class JMath < Jni::Object; end
+  class JString < Jni::Object; end
+  class JLong < Jni::Object; end
+  class JCharacter < Jni::Object; end
+  class JStringBuilder < Jni::Object; end
+  class JObjects < Jni::Object; end
+  class JArrays < Jni::Object; end
+  class JByteBuffer < Jni::Object; end
+  bind JInteger, 'java/lang/Integer'
+  bind JMath, 'java/lang/Math'
+  bind JString, 'java/lang/String'
+  bind JLong, 'java/lang/Long'
+  bind JCharacter, 'java/lang/Character'
+  bind JStringBuilder, 'java/lang/StringBuilder'
+  bind JObjects, 'java/util/Objects'
+  bind JArrays, 'java/util/Arrays'
+  bind JByteBuffer, 'java/nio/ByteBuffer'
+
+  Jni::Object.extend Mapping
+
+  def self.static(klass)
+    class << klass; self; end
+  end
+
+  if $jni_test_fixture
+    class Fixture < Jni::Object; end
+    bind Fixture, 'JniTestFixture'
+
+    def self.fixture
+      obj = Fixture.new
+      @fixture_init ||= jmethod(Fixture, T::Void, '<init>')
+      @fixture_init.call(obj, '<init>', [])
+      obj
+    end
+  end
+
+  def self.integer(i)
+    @value_of ||= jmethod(JInteger, JInteger, 'valueOf', [T::Int], true)
+    @value_of.call(JInteger, 'valueOf', [i])
+  end
+
+  def self.int_value(obj)
+    @int_value ||= jmethod(JInteger, T::Int, 'intValue')
+    @int_value.call(obj, 'intValue', [])
+  end
+
+  # the same Java object behind a plain Jni::Object, i.e. an unbound wrapper
+  def self.generic(obj)
+    @require_non_null ||= jmethod(JObjects, Jni::Object, 'requireNonNull', [Jni::Object], true)
+    @require_non_null.call(JObjects, 'requireNonNull', [obj])
+  end
+
+  def self.string_builder(str)
+    sb = JStringBuilder.new
+    @sb_init ||= jmethod(JStringBuilder, T::Void, '<init>', [T::Str])
+    @sb_init.call(sb, '<init>', [str])
+    sb
+  end
+
+  def self.string_of(obj)
+    @string_of ||= jmethod(JString, T::Str, 'valueOf', [Jni::Object], true)
+    @string_of.call(JString, 'valueOf', [obj])
+  end
+end
+
+class Jni::Method
+  def get_sig(ret, args)
+    "(#{args.map { |t| JniTest.sig(t) }.join})#{JniTest.sig(ret)}"
+  end
+end
+
+class Object
+  def name2class(name)
+    path = name.split('.').join('/')
+    return Jni::Object if path == 'java/lang/Object'
+    JniTest::PATHS.each { |klass, p| return klass if p == path }
+    nil
+  end
+end
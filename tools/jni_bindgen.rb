@@ -0,0 +1,287 @@
+# Generates specialized C bindings for Java classes from `javap -s` output.
+#
+#   ruby tools/jni_bindgen.rb -cp CLASSPATH -o jni_bindings.c classes.txt
+#
+# classes.txt lists one fully qualified class name per line.  Every public
+# method and constructor whose parameters and return type are primitives,
+# String or objects gets a C function with hard-coded argument unboxing and
+# lazily cached jclass/jmethodID.  Methods using arrays are skipped.  Object
+# results are wrapped in the class name2class maps their runtime class to.
+#
+# For each class a module Jni::Bound::<Mangled_name> is defined: instance
+# methods are meant to be included into the mruby class bound to that Java
+# class, static methods and constructors (`create`) are module functions.
+# Overloaded names get the JNI-style mangled parameter descriptor appended
+# after a double underscore, e.g. indexOf__Ljava_lang_String_2.
+
+module JniBindgen
+  Method = Struct.new(:name, :descriptor, :static, :constructor)
+
+  PRIMITIVES = {
+    'Z' => { ctype: 'jboolean', field: 'z', call: 'Boolean' },
+    'B' => { ctype: 'jbyte', field: 'b', call: 'Byte' },
+    'C' => { ctype: 'jchar', field: 'c', call: 'Char' },
+    'S' => { ctype: 'jshort', field: 's', call: 'Short' },
+    'I' => { ctype: 'jint', field: 'i', call: 'Int' },
+    'J' => { ctype: 'jlong', field: 'j', call: 'Long' },
+    'F' => { ctype: 'jfloat', field: 'f', call: 'Float' },
+    'D' => { ctype: 'jdouble', field: 'd', call: 'Double' },
+  }
+
+  module_function
+
+  def javap(classpath, klass)
+    javap = ENV['JAVA_HOME'] ? File.join(ENV['JAVA_HOME'], 'bin', 'javap') : 'javap'
+    cp = classpath ? ['-cp', classpath] : []
+    out = IO.popen([javap, '-s', '-public', *cp, klass], &:read)
+    raise "javap failed for #{klass}" unless $?.success?
+    out
+  end
+
+  def parse(klass, text)
+    simple = klass.split('.').last
+    methods = []
+    decl = nil
+    text.each_line do |line|
+      line = line.strip
+      if line.start_with?('descriptor:') && decl
+        name = decl[/([\w$]+)\(/, 1]
+        constructor = name == simple || decl =~ /\b#{Regexp.escape(klass)}\(/
+        methods << Method.new(constructor ? '<init>' : name, line.split(':', 2)[1].strip,
+                              decl =~ /\bstatic\b/ ? true : false, constructor ? true : false)
+        decl = nil
+      elsif line.include?('(') && line =~ /\)(\s+throws\s+[^;]+)?;\z/
+        decl = line
+      else
+        decl = nil
+      end
+    end
+    methods
+  end
+
+  # ["I", "Ljava/lang/String;"], "V"
+  def split_descriptor(desc)
+    params = desc[/\((.*)\)/, 1].scan(/\[*(?:L[^;]+;|[ZBCSIJFD])/)
+    [params, desc[/\)(.*)/, 1]]
+  end
+
+  def kind(type)
+    return :void if type == 'V'
+    return nil if type.start_with?('[')
+    return :string if type == 'Ljava/lang/String;'
+    return :object if type.start_with?('L')
+    :primitive
+  end
+
+  def supported?(m)
+    params, ret = split_descriptor(m.descriptor)
+    params.all? { |t| kind(t) && kind(t) != :void } && kind(ret)
+  end
+
+  def mangle(str)
+    str.gsub('_', '_1').gsub(';', '_2').gsub('[', '_3').gsub(/[\/.$]/, '_')
+  end
+
+  def c_ident(str)
+    str.gsub(/[^A-Za-z0-9]/, '_')
+  end
+
+  def ruby_name(m, overloaded)
+    base = m.constructor ? 'create' : m.name
+    return base unless overloaded
+    params, = split_descriptor(m.descriptor)
+    "#{base}__#{mangle(params.join)}"
+  end
+
+  def unbox(type, i)
+    case kind(type)
+    when :string
+      "args[#{i}].l = (jobject)mrb_mruby_jni_mstr2jstr(mrb, a#{i});"
+    when :object
+      "args[#{i}].l = mrb_mruby_jni_jobject(mrb, a#{i});"
+    else
+      p = PRIMITIVES[type]
+      case type
+      when 'Z' then "args[#{i}].z = mrb_test(a#{i});"
+      when 'J' then "args[#{i}].j = mrb_mruby_jni_mlong2jlong(mrb, a#{i});"
+      when 'F', 'D' then "args[#{i}].#{p[:field]} = (#{p[:ctype]})mrb_to_flo(mrb, a#{i});"
+      else "args[#{i}].#{p[:field]} = (#{p[:ctype]})mrb_fixnum(mrb_to_int(mrb, a#{i}));"
+      end
+    end
+  end
+
+  def box(type)
+    case kind(type)
+    when :void then 'self'
+    when :string then 'mrb_mruby_jni_jstr2mstr(mrb, (jstring)r)'
+    when :object then 'mrb_mruby_jni_jobj2mobj(mrb, self, r)'
+    else
+      case type
+      when 'Z' then 'mrb_bool_value(r)'
+      when 'J' then 'mrb_mruby_jni_jlong2mlong(mrb, r)'
+      when 'F', 'D' then 'mrb_float_value(mrb, r)'
+      else 'mrb_fixnum_value(r)'
+      end
+    end
+  end
+
+  def stub(prefix, klass_id, index, m, rname)
+    params, ret = split_descriptor(m.descriptor)
+    argc = params.size
+    lines = []
+    lines << "static mrb_value #{prefix}_#{index}(mrb_state *mrb, mrb_value self) { /* #{m.name}#{m.descriptor} */"
+    lines << '  JNIEnv *env = mrb_mruby_jni_env(mrb);'
+    lines << "  mrb_value #{(0...argc).map { |i| "a#{i}" }.join(', ')};" if argc > 0
+    lines << "  jvalue args[#{[argc, 1].max}];"
+    lines << '  jobject recv;' unless m.static || m.constructor
+    if m.constructor || kind(ret) == :string || kind(ret) == :object
+      lines << '  jobject r;'
+    elsif kind(ret) == :primitive
+      lines << "  #{PRIMITIVES[ret][:ctype]} r;"
+    end
+    lines << ''
+    lines << "  mrb_get_args(mrb, \"#{'o' * argc}\"#{(0...argc).map { |i| ", &a#{i}" }.join});" if argc > 0
+    lines << "  #{klass_id}_resolve(mrb, env);"
+    # Java strings are made last, once nothing else can raise and leak them
+    params.each_with_index { |t, i| lines << "  #{unbox(t, i)}" unless kind(t) == :string }
+    lines << '  recv = mrb_mruby_jni_jobject(mrb, self);' unless m.static || m.constructor
+    params.each_with_index do |t, i|
+      next unless kind(t) == :string
+      lines << "  if (!mrb_nil_p(a#{i}) && !mrb_string_p(a#{i})) {"
+      lines << "    mrb_raisef(mrb, E_TYPE_ERROR, \"Jni: #{rname} expects a String as argument #{i + 1}\");"
+      lines << '  }'
+    end
+    params.each_with_index { |t, i| lines << "  #{unbox(t, i)}" if kind(t) == :string }
+    target = "#{klass_id}_ids[#{index}]"
+    call = if m.constructor
+      "r = (*env)->NewObjectA(env, #{klass_id}_class, #{target}, args);"
+    elsif m.static
+      "#{kind(ret) == :void ? '' : 'r = '}(*env)->CallStatic#{call_type(ret)}MethodA(env, #{klass_id}_class, #{target}, args);"
+    else
+      "#{kind(ret) == :void ? '' : 'r = '}(*env)->Call#{call_type(ret)}MethodA(env, recv, #{target}, args);"
+    end
+    lines << "  #{call}"
+    params.each_with_index do |t, i|
+      lines << "  (*env)->DeleteLocalRef(env, args[#{i}].l);" if kind(t) == :string
+    end
+    lines << '  if ((*env)->ExceptionCheck(env)) {'
+    lines << "    mrb_mruby_jni_raise_jexc(mrb, \"#{rname}\");"
+    lines << '  }'
+    lines << "  return #{m.constructor ? box('Ljava/lang/Object;') : box(ret)};"
+    lines << '}'
+    lines.join("\n")
+  end
+
+  def call_type(ret)
+    case kind(ret)
+    when :void then 'Void'
+    when :string, :object then 'Object'
+    else PRIMITIVES[ret][:call]
+    end
+  end
+
+  def generate_class(klass, methods)
+    klass_id = "jbind_#{c_ident(klass)}"
+    methods = methods.select { |m| supported?(m) }
+    counts = Hash.new(0)
+    methods.each { |m| counts[[m.constructor ? 'create' : m.name, m.static || m.constructor]] += 1 }
+    out = []
+    out << "/* #{klass} */"
+    out << "static jclass #{klass_id}_class;"
+    out << "static jmethodID #{klass_id}_ids[#{[methods.size, 1].max}];"
+    out << "static pthread_mutex_t #{klass_id}_lock = PTHREAD_MUTEX_INITIALIZER;"
+    out << ''
+    out << '/* states on other threads may resolve at the same time; _class is published last */'
+    out << "static void #{klass_id}_resolve(mrb_state *mrb, JNIEnv *env) {"
+    out << '  jclass jclazz;'
+    out << ''
+    out << "  if (__atomic_load_n(&#{klass_id}_class, __ATOMIC_ACQUIRE)) {"
+    out << '    return;'
+    out << '  }'
+    out << "  pthread_mutex_lock(&#{klass_id}_lock);"
+    out << "  if (#{klass_id}_class) {"
+    out << "    pthread_mutex_unlock(&#{klass_id}_lock);"
+    out << '    return;'
+    out << '  }'
+    out << "  jclazz = (*env)->FindClass(env, \"#{klass.tr('.', '/')}\");"
+    out << '  if (!jclazz || (*env)->ExceptionCheck(env)) {'
+    out << '    (*env)->ExceptionClear(env);'
+    out << "    pthread_mutex_unlock(&#{klass_id}_lock);"
+    out << "    mrb_raisef(mrb, E_NAME_ERROR, \"Jni: can't find class #{klass}\");"
+    out << '  }'
+    methods.each_with_index do |m, i|
+      getter = m.static ? 'GetStaticMethodID' : 'GetMethodID'
+      out << "  #{klass_id}_ids[#{i}] = (*env)->#{getter}(env, jclazz, \"#{m.name}\", \"#{m.descriptor}\");"
+    end
+    out << '  if ((*env)->ExceptionCheck(env)) {'
+    out << '    (*env)->ExceptionClear(env);'
+    out << '    (*env)->DeleteLocalRef(env, jclazz);'
+    out << "    pthread_mutex_unlock(&#{klass_id}_lock);"
+    out << "    mrb_raisef(mrb, E_NAME_ERROR, \"Jni: bindings for #{klass} are out of date\");"
+    out << '  }'
+    out << "  __atomic_store_n(&#{klass_id}_class, (jclass)(*env)->NewGlobalRef(env, jclazz), __ATOMIC_RELEASE);"
+    out << "  pthread_mutex_unlock(&#{klass_id}_lock);"
+    out << '  (*env)->DeleteLocalRef(env, jclazz);'
+    out << '}'
+    out << ''
+    defs = []
+    methods.each_with_index do |m, i|
+      static = m.static || m.constructor
+      rname = ruby_name(m, counts[[m.constructor ? 'create' : m.name, static]] > 1)
+      out << stub(klass_id, klass_id, i, m, rname)
+      out << ''
+      definer = static ? 'mrb_define_module_function' : 'mrb_define_method'
+      argc = split_descriptor(m.descriptor)[0].size
+      defs << "  #{definer}(mrb, mod, \"#{rname}\", #{klass_id}_#{i}, ARGS_REQ(#{argc}));"
+    end
+    [out.join("\n"), klass_id, defs]
+  end
+
+  def generate(classes, classpath)
+    body = []
+    inits = []
+    classes.each do |klass|
+      text, klass_id, defs = generate_class(klass, parse(klass, javap(classpath, klass)))
+      body << text
+      inits << "  mod = mrb_define_module_under(mrb, bound, \"#{c_ident(klass).sub(/\A./) { |c| c.upcase }}\");"
+      inits.concat(defs)
+    end
+    <<-EOS
+/* generated by tools/jni_bindgen.rb; do not edit */
+#include <jni.h>
+#include <pthread.h>
+#include <mruby.h>
+#include <mruby/class.h>
+#include <mruby/string.h>
+#include "mruby-jni.h"
+
+#{body.join("\n")}
+void mrb_mruby_jni_bindings_init(mrb_state *mrb) {
+  struct RClass *bound, *mod;
+
+  bound = mrb_define_module_under(mrb, mrb_module_get(mrb, "Jni"), "Bound");
+#{inits.join("\n")}
+  (void)mod;
+}
+    EOS
+  end
+
+  def run(argv)
+    classpath = nil
+    output = nil
+    files = []
+    until argv.empty?
+      arg = argv.shift
+      case arg
+      when '-cp', '-classpath' then classpath = argv.shift
+      when '-o' then output = argv.shift
+      else files << arg
+      end
+    end
+    classes = files.flat_map { |f| File.readlines(f) }.map(&:strip).reject { |l| l.empty? || l.start_with?('#') }
+    src = generate(classes, classpath)
+    output ? File.write(output, src) : print(src)
+  end
+end
+
+JniBindgen.run(ARGV.dup) if $0 == __FILE__
@@ -0,0 +1,42 @@
+/* Fixture for mruby-jni-bench; every method returns a constant or echoes. */
+public class JniBench {
+  public static JniBench shared = new JniBench();
+
+  public JniBench() {}
+
+  public void v() {}
+  public boolean z() { return true; }
+  public byte b() { return 1; }
+  public char c() { return 'a'; }
+  public short s() { return 2; }
+  public int i() { return 3; }
+  public long j() { return 4L; }
+  public float f() { return 5.0f; }
+  public double d() { return 6.0; }
+  public String str() { return "seven"; }
+  public JniBench obj() { return this; }
+  public JniBench fresh() { return new JniBench(); }
+  public int[] ints() { return new int[] { 1, 2, 3, 4, 5, 6, 7, 8 }; }
+
+  public static void sv() {}
+  public static boolean sz() { return true; }
+  public static byte sb() { return 1; }
+  public static char sc() { return 'a'; }
+  public static short ss() { return 2; }
+  public static int si() { return 3; }
+  public static long sj() { return 4L; }
+  public static float sf() { return 5.0f; }
+  public static double sd() { return 6.0; }
+  public static String sstr() { return "seven"; }
+  public static JniBench sobj() { return shared; }
+  public static int[] sints() { return new int[] { 1, 2, 3, 4, 5, 6, 7, 8 }; }
+
+  public static int add(int a, int b) { return a + b; }
+  public static long add(long a, long b) { return a + b; }
+  public static String add(String a, String b) { return a; }
+  public static double add(double a, double b) { return a + b; }
+
+  public static String echo(String s) { return s; }
+  public static long echo(long l) { return l; }
+  public static int[] echo(int[] a) { return a; }
+}
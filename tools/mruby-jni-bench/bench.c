@@ -0,0 +1,159 @@
+/*
+ * mruby-jni-bench: starts a JVM with the JniBench fixture on its class path
+ * and runs bench.rb, which prints ns/call figures as one JSON object.
+ *
+ *   mruby-jni-bench [-n iterations] [-cp classpath] [script]
+ */
+#include <jni.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <mruby.h>
+#include <mruby/compile.h>
+#include <mruby/variable.h>
+#include "mruby-jni.h"
+
+#ifndef MRUBY_JNI_BENCH_DIR
+#define MRUBY_JNI_BENCH_DIR "."
+#endif
+#ifndef MRUBY_JNI_BENCH_CLASSPATH
+#define MRUBY_JNI_BENCH_CLASSPATH MRUBY_JNI_BENCH_DIR
+#endif
+
+static double bench_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Bench.measure(n) { ... }: ns per run of the block, loop included */
+static mrb_value bench_s__measure(mrb_state *mrb, mrb_value self) {
+  mrb_value mblk;
+  mrb_int n, i;
+  double t;
+  int ai;
+
+  mrb_get_args(mrb, "i&", &n, &mblk);
+  if (n <= 0 || mrb_nil_p(mblk)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "Bench.measure needs a positive count and a block");
+  }
+  ai = mrb_gc_arena_save(mrb);
+  t = bench_now_ns();
+  for (i = 0; i < n; i++) {
+    mrb_yield(mrb, mblk, mrb_fixnum_value(i));
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  return mrb_float_value(mrb, (bench_now_ns() - t) / n);
+}
+
+static char *bench_read(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  char *buf;
+  long size;
+
+  if (!fp) {
+    return NULL;
+  }
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  buf = (char *)malloc(size + 1);
+  if (!buf || fread(buf, 1, size, fp) != (size_t)size) {
+    free(buf);
+    fclose(fp);
+    return NULL;
+  }
+  buf[size] = '\0';
+  fclose(fp);
+  return buf;
+}
+
+int main(int argc, char **argv) {
+  const char *cp = MRUBY_JNI_BENCH_CLASSPATH;
+  const char *script = MRUBY_JNI_BENCH_DIR "/bench.rb";
+  long iterations = 100000;
+  JavaVM *vm;
+  JNIEnv *env;
+  JavaVMInitArgs vm_args;
+  JavaVMOption option;
+  char *cp_opt, *src;
+  mrb_state *mrb;
+  struct RClass *bench;
+  int i, status = 0;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      iterations = atol(argv[++i]);
+    } else if (!strcmp(argv[i], "-cp") && i + 1 < argc) {
+      cp = argv[++i];
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "usage: %s [-n iterations] [-cp classpath] [script]\n", argv[0]);
+      return 2;
+    } else {
+      script = argv[i];
+    }
+  }
+  if (iterations <= 0) {
+    fprintf(stderr, "%s: iteration count must be positive\n", argv[0]);
+    return 2;
+  }
+  src = bench_read(script);
+  if (!src) {
+    fprintf(stderr, "%s: can't read %s\n", argv[0], script);
+    return 1;
+  }
+
+  cp_opt = (char *)malloc(strlen(cp) + sizeof("-Djava.class.path="));
+  if (!cp_opt) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    free(src);
+    return 1;
+  }
+  sprintf(cp_opt, "-Djava.class.path=%s", cp);
+  option.optionString = cp_opt;
+  vm_args.version = JNI_VERSION_1_6;
+  vm_args.nOptions = 1;
+  vm_args.options = &option;
+  vm_args.ignoreUnrecognized = JNI_FALSE;
+  if (JNI_CreateJavaVM(&vm, (void **)&env, &vm_args) != JNI_OK) {
+    fprintf(stderr, "%s: can't create Java VM\n", argv[0]);
+    free(cp_opt);
+    free(src);
+    return 1;
+  }
+
+  mrb = mrb_open();
+  if (!mrb) {
+    fprintf(stderr, "%s: can't open mruby state\n", argv[0]);
+    (*vm)->DestroyJavaVM(vm);
+    free(cp_opt);
+    free(src);
+    return 1;
+  }
+  mrb->ud = env;
+  if (!mrb_mruby_jni_init(mrb)) {
+    fprintf(stderr, "%s: can't initialize mruby-jni\n", argv[0]);
+    mrb->ud = NULL;
+    mrb_close(mrb);
+    (*vm)->DestroyJavaVM(vm);
+    free(cp_opt);
+    free(src);
+    return 1;
+  }
+  bench = mrb_define_module(mrb, "Bench");
+  mrb_define_module_function(mrb, bench, "measure", bench_s__measure, ARGS_REQ(1));
+  mrb_gv_set(mrb, mrb_intern_cstr(mrb, "$bench_iterations"), mrb_fixnum_value(iterations));
+
+  mrb_load_string(mrb, src);
+  if (mrb->exc) {
+    mrb_print_error(mrb);
+    status = 1;
+  }
+  mrb_close(mrb);
+  (*vm)->DestroyJavaVM(vm);
+  free(cp_opt);
+  free(src);
+  return status;
+}
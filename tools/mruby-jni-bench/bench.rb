@@ -0,0 +1,149 @@
+# Benchmarks for mruby-jni call paths against the JniBench fixture.  Prints
+# one JSON object: {"iterations": N, "loop_ns": L, "results": {name: ns}},
+# where every figure is ns per call with the Bench.measure loop subtracted.
+#
+# The gem leaves name/signature mapping to the embedding application; the
+# small mapping below only covers what the fixture needs.
+
+module Bench
+  module T
+    class Void; end
+    class Bool; end
+    class Byte; end
+    class Char; end
+    class Short; end
+    class Int; end
+    class Long; end
+    class Float; end
+    class Double; end
+    class Str; end
+  end
+
+  TYPES = {
+    T::Void => 'V', T::Bool => 'Z', T::Byte => 'B', T::Char => 'C',
+    T::Short => 'S', T::Int => 'I', T::Long => 'J', T::Float => 'F',
+    T::Double => 'D', T::Str => 's',
+  }
+
+  class Fixture < Jni::Object
+    extend Jni::Definition
+    self.class_path = 'JniBench'
+
+    def self.get_type(args)
+      args.map { |t| Bench.type(t) }.join
+    end
+
+    def self.class2type(ret)
+      TYPES[ret] || 'L'
+    end
+
+    def name2class(name)
+      name == 'JniBench' ? Fixture : nil
+    end
+  end
+
+  def self.type(t)
+    return "[#{type(t[0])}" if t.is_a?(Array)
+    return 'LJniBench;' if t == Fixture
+    TYPES[t]
+  end
+
+  def self.sig(t)
+    s = type(t)
+    s[-1] == 's' ? "#{s[0...-1]}Ljava/lang/String;" : s
+  end
+end
+
+class Jni::Method
+  def get_sig(ret, args)
+    "(#{args.map { |t| Bench.sig(t) }.join})#{Bench.sig(ret)}"
+  end
+end
+
+module Bench
+  N = $bench_iterations
+  RESULTS = []
+  LOOP_NS = measure(N) { }
+
+  def self.run(name, n = N, &blk)
+    ns = measure(n, &blk) - LOOP_NS
+    RESULTS << [name, ns < 0 ? 0.0 : ns]
+  end
+
+  def self.jmethod(ret, name, args = [], static = false)
+    klass = static ? (class << Fixture; self; end) : Fixture
+    Jni::Method.new(klass, ret, name, args)
+  end
+
+  def self.json
+    body = RESULTS.map { |name, ns| "    #{name.inspect}: #{ns.round(1)}" }.join(",\n")
+    "{\n  \"iterations\": #{N},\n  \"loop_ns\": #{LOOP_NS.round(1)},\n  \"results\": {\n#{body}\n  }\n}"
+  end
+end
+
+include Bench
+
+fixture = Fixture.new
+ctor = Bench.jmethod(T::Void, '<init>')
+ctor.call(fixture, '<init>', [])
+none = []
+
+# one trampoline per return type and call kind
+RETURNS = [
+  ['void', T::Void, 'v'], ['bool', T::Bool, 'z'], ['byte', T::Byte, 'b'],
+  ['char', T::Char, 'c'], ['short', T::Short, 's'], ['int', T::Int, 'i'],
+  ['long', T::Long, 'j'], ['float', T::Float, 'f'], ['double', T::Double, 'd'],
+  ['str', T::Str, 'str'], ['obj', Fixture, 'obj'], ['ary', [T::Int], 'ints'],
+]
+RETURNS.each do |label, ret, name|
+  m = Bench.jmethod(ret, name)
+  Bench.run("caller.instance.#{label}") { m.call(fixture, name, none) }
+  m.nonvirtual = true
+  Bench.run("caller.nonvirtual.#{label}") { m.call(fixture, name, none) }
+  sm = Bench.jmethod(ret, "s#{name}", [], true)
+  Bench.run("caller.static.#{label}") { sm.call(Fixture, "s#{name}", none) }
+end
+view = Bench.jmethod([T::Int], 'ints')
+view.array_view = true
+Bench.run('caller.instance.ary_view') { view.call(fixture, 'ints', none) }
+
+# overload resolution
+adds = [[T::Int, T::Int], [T::Long, T::Long], [T::Str, T::Str], [T::Double, T::Double]].map do |args|
+  Bench.jmethod(args[0], 'add', args, true)
+end
+int_args = [1, 2]
+str_args = ['a', 'b']
+Bench.run('check.match') { adds[0].check(int_args) }
+Bench.run('check.mismatch') { adds[0].check(str_args) }
+Bench.run('check.scan') { adds.find { |m| m.check(str_args) } }
+site = Jni::CallSite.new(adds)
+Bench.run('callsite.resolve') { site.resolve(str_args) }
+Bench.run('callsite.call') { site.call(Fixture, 'add', int_args) }
+
+# argument and return conversion
+echo_str = Bench.jmethod(T::Str, 'echo', [T::Str], true)
+echo_long = Bench.jmethod(T::Long, 'echo', [T::Long], true)
+echo_ints = Bench.jmethod([T::Int], 'echo', [[T::Int]], true)
+short_str = ['short']
+long_str = ['x' * 1024]
+small_long = [42]
+big_long = [Jni::Long.new(1, 0)]
+ints = [[1, 2, 3, 4, 5, 6, 7, 8]]
+Bench.run('convert.string.short') { echo_str.call(Fixture, 'echo', short_str) }
+Bench.run('convert.string.1k') { echo_str.call(Fixture, 'echo', long_str) }
+Bench.run('convert.long.fixnum') { echo_long.call(Fixture, 'echo', small_long) }
+Bench.run('convert.long.boxed') { echo_long.call(Fixture, 'echo', big_long) }
+Bench.run('convert.int_array.8') { echo_ints.call(Fixture, 'echo', ints) }
+Jni.string_benchmark('short', N).each do |path, ns|
+  RESULTS << ["convert.string.to_mruby.#{path}", ns]
+end
+
+# wrapper allocation and collection
+fresh = Bench.jmethod(Fixture, 'fresh')
+Bench.run('wrapper.alloc') { fresh.call(fixture, 'fresh', none) }
+live = (0...10000).map { fresh.call(fixture, 'fresh', none) }
+Bench.run('wrapper.gc.10k_live', 10) { GC.start }
+live = nil
+Bench.run('wrapper.gc.10k_dead', 1) { GC.start; Jni.flush_refs }
+
+puts Bench.json